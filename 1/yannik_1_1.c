@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <math.h>
 #include <time.h>
 
@@ -10,14 +11,27 @@ typedef struct SimulationState {
     int number_of_balls;
     int number_of_compartments;
     int number_of_rows;
+    bool bit_parallel;
 } SimulationState;
 
+//State of the 64 bit generator used by the bit-parallel simulation (splitmix64)
+static uint64_t random_state;
+
 bool ball_goes_right() {
     return rand() % 2 == 0;
 }
 
 void set_random_seed() {
     srand(time(0));
+    random_state = (uint64_t)time(0);
+}
+
+//rand() only guarantees 15 random bits per call, splitmix64 delivers 64 at once
+uint64_t random_64_bits() {
+    uint64_t z = (random_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
 }
 
 int safely_read_integer() {
@@ -186,6 +200,39 @@ int* run_simulation(SimulationState state) {
     return histogram;
 }
 
+/*
+The compartment of a ball is the number of times it went right, so a ball is
+fully described by number_of_rows random bits. They are drawn 64 at a time and
+counted with popcount.
+*/
+int count_right_turns(int number_of_rows) {
+    int right_turns = 0;
+    int remaining_rows = number_of_rows;
+    for(; remaining_rows >= 64; remaining_rows -= 64) {
+        right_turns += __builtin_popcountll(random_64_bits());
+    }
+    if(remaining_rows > 0) {
+        uint64_t mask = (UINT64_C(1) << remaining_rows) - 1;
+        right_turns += __builtin_popcountll(random_64_bits() & mask);
+    }
+
+    return right_turns;
+}
+
+//Same histogram contract as run_simulation, but O(balls * rows / 64) instead of O(balls * rows^2)
+int* run_simulation_bit_parallel(SimulationState state) {
+    set_random_seed();
+
+    int* histogram = (int*)malloc(state.number_of_compartments * sizeof(int));
+    init_array_with(histogram, state.number_of_compartments, 0);
+
+    for(int i = 0; i < state.number_of_balls; ++i) {
+        ++histogram[count_right_turns(state.number_of_rows)];
+    }
+
+    return histogram;
+}
+
 SimulationState read_simulation_state() {
     SimulationState state = {.number_of_balls = -1, .number_of_compartments = -1};
 
@@ -205,6 +252,14 @@ SimulationState read_simulation_state() {
     }
     state.number_of_rows = state.number_of_compartments - 1;
 
+    printf("Use the bit-parallel simulation? It skips the board and is a lot faster.\n");
+    int bit_parallel = -1;
+    while(bit_parallel != 0 && bit_parallel != 1) {
+        printf("Type 1 for yes, 0 for no.\n");
+        bit_parallel = safely_read_integer();
+    }
+    state.bit_parallel = bit_parallel;
+
     printf("\nRunning simulation with: \n"
            "Number of balls: %d\n"
            "Number of compartments: %d\n\n", 
@@ -216,7 +271,7 @@ SimulationState read_simulation_state() {
 int main() {
     SimulationState state = read_simulation_state();
 
-    int* histogram = run_simulation(state);
+    int* histogram = state.bit_parallel? run_simulation_bit_parallel(state) : run_simulation(state);
     display_histogram(histogram, state);
 
     return 0;
@@ -1,71 +1,193 @@
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <assert.h>
 #include <stdio.h>
 #include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 typedef struct NODE Node;
 
 //=============================================================================
-//Stack
+//Pool allocator
 //=============================================================================
 
-//The stack is used to remember the unvisited nodes when traversing the tree iteratively
-//A dynamic array would've also been possible, but the stack is easier to use
-typedef struct STACK_ELEMENT StackElement;
+//Hands out elements of a fixed size from big chunks instead of calling malloc
+//for every element. Freed elements go to a free list and are handed out again
+//first. Destroying the pool frees all elements at once in O(number of chunks)
+typedef struct POOL_CHUNK PoolChunk;
 
-struct STACK_ELEMENT {
-    Node* value;
-    StackElement *next;
+struct POOL_CHUNK {
+    PoolChunk* next;
+    size_t capacity;
+    size_t used;
+    max_align_t elements[]; //capacity elements of the pool's element_size
 };
 
+typedef struct {
+    size_t element_size;
+    PoolChunk* chunks; //The newest chunk first, it's the only one with room
+    void* free_list; //Freed elements, linked through their first bytes
+} Pool;
+
+//Every chunk is twice as big as the previous one, up to the maximum
+#define POOL_FIRST_CHUNK_CAPACITY 64
+#define POOL_MAX_CHUNK_CAPACITY 65536
+
+Pool pool_create(size_t element_size) {
+    //Room for the free list pointer, and every element stays aligned
+    size_t alignment = sizeof(void*);
+    Pool pool = {
+        .element_size = (element_size + alignment - 1) / alignment * alignment,
+        .chunks = NULL,
+        .free_list = NULL
+    };
+
+    return pool;
+}
+
+void* pool_allocate(Pool* pool) {
+    if(pool->free_list) {
+        void* element = pool->free_list;
+        pool->free_list = *(void**)element;
+        return element;
+    }
+
+    PoolChunk* chunk = pool->chunks;
+    if(!chunk || chunk->used == chunk->capacity) {
+        size_t capacity = chunk? 2*chunk->capacity : POOL_FIRST_CHUNK_CAPACITY;
+        if(capacity > POOL_MAX_CHUNK_CAPACITY) {
+            capacity = POOL_MAX_CHUNK_CAPACITY;
+        }
+        size_t bytes = sizeof(PoolChunk) + capacity*pool->element_size;
+        chunk = (PoolChunk*)malloc(bytes);
+        chunk->next = pool->chunks;
+        chunk->capacity = capacity;
+        chunk->used = 0;
+        pool->chunks = chunk;
+    }
+
+    return (char*)chunk->elements + chunk->used++ * pool->element_size;
+}
+
+//Allocates count consecutive elements in a chunk of their own
+void* pool_allocate_array(Pool* pool, size_t count) {
+    PoolChunk* chunk = (PoolChunk*)malloc(sizeof(PoolChunk)
+                                          + count*pool->element_size);
+    chunk->capacity = count;
+    chunk->used = count;
+
+    //Behind the newest chunk, so the room left in that one isn't lost
+    if(pool->chunks) {
+        chunk->next = pool->chunks->next;
+        pool->chunks->next = chunk;
+    }
+    else {
+        chunk->next = NULL;
+        pool->chunks = chunk;
+    }
+
+    return chunk->elements;
+}
+
+void pool_free(Pool* pool, void* element) {
+    *(void**)element = pool->free_list;
+    pool->free_list = element;
+}
+
+//Moves all elements of from into pool, from is empty afterwards. Takes
+//O(chunks of from + free elements of from)
+void pool_merge(Pool* pool, Pool* from) {
+    assert(pool->element_size == from->element_size);
+    if(from->chunks) {
+        PoolChunk* last = from->chunks;
+        while(last->next) {
+            last = last->next;
+        }
+        //Behind the newest chunk of pool, so the room left in that one isn't
+        //lost
+        if(pool->chunks) {
+            last->next = pool->chunks->next;
+            pool->chunks->next = from->chunks;
+        }
+        else {
+            pool->chunks = from->chunks;
+        }
+        from->chunks = NULL;
+    }
+
+    while(from->free_list) {
+        void* element = from->free_list;
+        from->free_list = *(void**)element;
+        pool_free(pool, element);
+    }
+}
+
+void pool_destroy(Pool* pool) {
+    while(pool->chunks) {
+        PoolChunk* next = pool->chunks->next;
+        free(pool->chunks);
+        pool->chunks = next;
+    }
+    pool->free_list = NULL;
+}
+
+//=============================================================================
+//Stack
+//=============================================================================
+
+//The stack is used to remember the unvisited nodes when traversing the tree
+//iteratively. It's a dynamic array that doubles its capacity when it's full,
+//so pushing and popping only touch the end of one contiguous block
 typedef struct Stack {
-    StackElement* top;
+    Node** elements;
+    size_t size;
+    size_t capacity;
 } Stack;
 
+#define STACK_FIRST_CAPACITY 64
+
 Stack stack_create() {
     Stack stack;
-    stack.top = NULL;
+    stack.elements = NULL;
+    stack.size = 0;
+    stack.capacity = 0;
 
     return stack;
 }
 
-StackElement* stack_create_node(Node* value) {
-    StackElement* element = (StackElement*)malloc(sizeof(StackElement));
-    element->value = value;
-    element->next = NULL;
-
-    return element;
-}
-
 void stack_push(Stack* stack, Node* value) {
-    if(stack->top == NULL) {
-        stack->top = stack_create_node(value);
-        return;
+    if(stack->size == stack->capacity) {
+        stack->capacity = stack->capacity? 2*stack->capacity
+                                         : STACK_FIRST_CAPACITY;
+        stack->elements = (Node**)realloc(stack->elements,
+                                          stack->capacity*sizeof(Node*));
     }
-
-    StackElement* element = stack_create_node(value);
-    element->next = stack->top;
-    stack->top = element;
+    stack->elements[stack->size++] = value;
 }
 
 Node* stack_pop(Stack* stack) {
-    Node* value = stack->top->value;
-    StackElement* top = stack->top;
-    stack->top = stack->top->next;
-    free(top);
-
-    return value;
+    return stack->elements[--stack->size];
 }
 
 bool stack_empty(Stack stack) {
-    return stack.top == NULL;
+    return stack.size == 0;
+}
+
+//Empties the stack but keeps its memory for the next pushes
+void stack_clear(Stack* stack) {
+    stack->size = 0;
 }
 
 void stack_delete(Stack* stack) {
-    while(!stack_empty(*stack)) {
-        stack_pop(stack);
-    }
+    free(stack->elements);
+    *stack = stack_create();
 }
 
 //=============================================================================
@@ -74,24 +196,29 @@ void stack_delete(Stack* stack) {
 
 struct NODE {
     int key;
+    int height; //Only maintained by tree_insert_key_balanced, a leaf has 1
     Node* smaller_keys; 
     Node* larger_keys;
 };
 
+//The tree owns the memory of its nodes, they are allocated from its pool
 typedef struct { 
     Node* root;
+    Pool nodes;
 } Tree;
 
 Tree tree_create() {
     Tree tree;
     tree.root = NULL;
+    tree.nodes = pool_create(sizeof(Node));
 
     return tree;
 }
 
-Node* node_create(int key) {
-    Node* node = (Node*)malloc(sizeof(Node));
+Node* node_create(Tree* tree, int key) {
+    Node* node = (Node*)pool_allocate(&tree->nodes);
     node->key = key;
+    node->height = 1;
     node->smaller_keys = NULL;
     node->larger_keys = NULL;
 
@@ -118,7 +245,7 @@ bool tree_find_key_recursive(Tree tree, int key) {
 }
 
 Node* tree_insert_key(Tree* tree, int key) {
-    Node* new_node = node_create(key);
+    Node* new_node = node_create(tree, key);
     if(!tree->root) {
         tree->root = new_node;
         return new_node;
@@ -141,7 +268,7 @@ Node* tree_insert_key(Tree* tree, int key) {
             current = current->larger_keys;
         }
         else {
-            free(new_node);
+            pool_free(&tree->nodes, new_node);
             return NULL; //Ignore duplicates
         }
     }
@@ -149,55 +276,36 @@ Node* tree_insert_key(Tree* tree, int key) {
     return NULL;
 }
 
-//tree_deep_copy, tree_delete and tree_is_valid use iterative traversion of the tree.
-//To avoid code duplication, the traversal part is taken care of by the
-//TreeTraverser struct
+//The stacks of a traversal: nodes holds the nodes still to be visited,
+//partners whatever a traversal keeps for each of them at the same position.
+//Passing the same scratch to many traversals reuses its memory, so only the
+//first traversals have to grow the stacks
 typedef struct {
-    Node* current;
-    Stack left_turns;
-    Stack right_turns;
-} TreeTraverser;
-
-TreeTraverser tree_traverser_create(Node* node) {
-    TreeTraverser t = {
-        .current = node, 
-        .left_turns = stack_create(),
-        .right_turns = stack_create()
+    Stack nodes;
+    Stack partners;
+} TraversalScratch;
+
+TraversalScratch traversal_scratch_create() {
+    TraversalScratch scratch = {
+        .nodes = stack_create(),
+        .partners = stack_create()
     };
 
-    return t;
+    return scratch;
 }
 
-void tree_traverser_delete(TreeTraverser* tree_traverser) {
-    stack_delete(&tree_traverser->left_turns);
-    stack_delete(&tree_traverser->right_turns);
+void traversal_scratch_delete(TraversalScratch* scratch) {
+    stack_delete(&scratch->nodes);
+    stack_delete(&scratch->partners);
 }
 
-//Traversing a tree iteratively: If the current node has left or right children,
-//add them to the stacks of nodes to be visited. If the stacks contain nodes, take
-//one from the top. Otherwise, set the current node to NULL, indicating that
-//traversal is over.
-void move_to_next_level(TreeTraverser* t) {
-    if(t->current->smaller_keys) {
-        stack_push(&t->left_turns, t->current->smaller_keys);
-    }
-    if(t->current->larger_keys) {
-        stack_push(&t->right_turns, t->current->larger_keys);
-    }
-
-    if(!stack_empty(t->left_turns)) {
-        t->current = stack_pop(&t->left_turns);
-    }
-    else if(!stack_empty(t->right_turns)) {
-        t->current = stack_pop(&t->right_turns);
-    }
-    else {
-        t->current = NULL;
-    }
-}
+//The tree functions that take a scratch use one of their own if it's NULL and
+//delete it before they return, so they can run on many threads at once
+TraversalScratch* traversal_scratch_or_own(TraversalScratch* scratch,
+                                           TraversalScratch* own) {
+    *own = traversal_scratch_create();
 
-bool tree_traverser_end_reached(TreeTraverser t) {
-    return t.current == NULL;
+    return scratch? scratch : own;
 }
 
 Node* tree_find_key_iterative(Tree tree, int key) {
@@ -218,153 +326,1900 @@ Node* tree_find_key_iterative(Tree tree, int key) {
     return NULL;
 }
 
-/*Checks if a subtree of a node is valid. Mechanism:
-1. Get the maximum key of the subtree to the left.
-2. If the maximum is greater or equal to the node's value, the tree is invalid.
-Same for right subtree, but reversed.
-*/
-bool _is_valid(Node node) {
-    if(!node.smaller_keys && !node.larger_keys) {
-        return true;
+//The number of searches tree_find_keys_batch advances at the same time
+#define BATCH_WIDTH 16
+
+//Like tree_find_key_iterative for every key: out[i] is the node with keys[i]
+//or NULL. Mechanism: Up to BATCH_WIDTH searches take turns going down one
+//level, and each prefetches the node it will look at in its next turn. The
+//cache misses of the searches overlap instead of happening one after another.
+//A finished search makes room for the next key
+void tree_find_keys_batch(Tree tree, const int* keys, size_t n, Node** out) {
+    Node* current[BATCH_WIDTH];
+    size_t query[BATCH_WIDTH];
+    size_t next = 0;
+    int active = 0;
+    while(active < BATCH_WIDTH && next < n) {
+        current[active] = tree.root;
+        query[active++] = next++;
     }
 
-    if(node.smaller_keys) {
-        int left_min = INT_MAX;
-        Node* current = node.smaller_keys;
-        while(current) {
-            if(current->key < left_min) {
-                left_min = current->key;
+    while(active > 0) {
+        for(int i = 0; i < active;) {
+            Node* node = current[i];
+            int key = keys[query[i]];
+            if(!node || node->key == key) {
+                out[query[i]] = node;
+                if(next < n) {
+                    current[i] = tree.root;
+                    query[i++] = next++;
+                }
+                else { //The last search takes its place
+                    --active;
+                    current[i] = current[active];
+                    query[i] = query[active];
+                }
+                continue;
             }
-            current = current->smaller_keys;
+
+            node = key > node->key? node->larger_keys : node->smaller_keys;
+            if(node) {
+                __builtin_prefetch(node);
+            }
+            current[i++] = node;
+        }
+    }
+}
+
+//An AVL tree with n nodes is at most 1.44*log2(n + 2) deep, below 64 for every
+//number of nodes that fits in memory
+#define AVL_MAX_DEPTH 64
+
+//The nodes from the root down to some node of a tree. They stay in the local
+//array, only the path of a tree that isn't balanced can be longer and then
+//moves to the heap. Initialized in place because nodes may point into it
+typedef struct {
+    Node** nodes;
+    size_t length;
+    size_t capacity;
+    Node* local[AVL_MAX_DEPTH];
+} NodePath;
+
+void node_path_init(NodePath* path) {
+    path->nodes = path->local;
+    path->length = 0;
+    path->capacity = AVL_MAX_DEPTH;
+}
+
+void node_path_push(NodePath* path, Node* node) {
+    if(path->length == path->capacity) {
+        path->capacity *= 2;
+        if(path->nodes == path->local) {
+            path->nodes = (Node**)malloc(path->capacity * sizeof(Node*));
+            memcpy(path->nodes, path->local, sizeof(path->local));
         }
-        if(left_min >= node.key) {
-            return false;
+        else {
+            path->nodes = (Node**)realloc(path->nodes,
+                                          path->capacity * sizeof(Node*));
         }
     }
-    if(node.larger_keys) {
-        int right_max = INT_MIN;
-        Node* current = node.larger_keys;
+    path->nodes[path->length++] = node;
+}
+
+void node_path_delete(NodePath* path) {
+    if(path->nodes != path->local) {
+        free(path->nodes);
+    }
+}
+
+//Checks that the keys of a subtree are strictly increasing in order and all
+//lie between low and high (exclusive). That's the case for every subtree
+//exactly if the whole tree is a valid search tree. Every node is visited once,
+//the path to the current node only allocates if it's deeper than
+//AVL_MAX_DEPTH. The nodes aren't written to, unlike in a Morris traversal,
+//because persistent versions share them with readers on other threads
+bool subtree_is_valid(Node* root, long long low, long long high) {
+    NodePath path;
+    node_path_init(&path);
+    bool valid = true;
+    long long previous = low;
+    Node* current = root;
+    while(valid && (current || path.length > 0)) {
         while(current) {
-            if(current->key > right_max) {
-                right_max = current->key;
-            }
-            current = current->larger_keys;
-        }
-        if(right_max <= node.key) {
-            return false;
+            node_path_push(&path, current);
+            current = current->smaller_keys;
         }
+        current = path.nodes[--path.length];
+        valid = current->key > previous;
+        previous = current->key;
+        current = current->larger_keys;
     }
+    node_path_delete(&path);
 
-    return true;
+    return valid && previous < high;
 }
 
+//The bounds are outside of the range of int, so every key lies between them
+#define NO_LOWER_BOUND ((long long)INT_MIN - 1)
+#define NO_UPPER_BOUND ((long long)INT_MAX + 1)
+
 bool tree_is_valid(Tree tree) {
-    TreeTraverser t = tree_traverser_create(tree.root);
-    while(!tree_traverser_end_reached(t)) {
-        if(!_is_valid(*t.current)) {
-            tree_traverser_delete(&t);
-            return false;
+    return subtree_is_valid(tree.root, NO_LOWER_BOUND, NO_UPPER_BOUND);
+}
+
+//The first levels below the root are split into tasks, 2^depth of them
+#define PARALLEL_VALIDATION_DEPTH 8
+
+#ifdef _OPENMP
+//Checks the node against the bounds of its position, then its subtrees with
+//the bounds narrowed by its key in two tasks
+void subtree_check_parallel(Node* node, long long low, long long high,
+                            int depth, bool* valid) {
+    if(!node) {
+        return;
+    }
+    bool node_valid;
+    if(depth > 0) {
+        node_valid = low < node->key && node->key < high;
+    }
+    else {
+        node_valid = subtree_is_valid(node, low, high);
+    }
+    if(!node_valid) {
+        #pragma omp atomic write
+        *valid = false;
+    }
+    if(depth == 0 || !node_valid) {
+        return;
+    }
+
+    #pragma omp task
+    subtree_check_parallel(node->smaller_keys, low, node->key, depth - 1,
+                           valid);
+    subtree_check_parallel(node->larger_keys, node->key, high, depth - 1,
+                           valid);
+    #pragma omp taskwait
+}
+#endif
+
+//Same result as tree_is_valid, the subtrees below the first levels are
+//checked by different threads. Without -fopenmp it's tree_is_valid
+bool tree_is_valid_parallel(Tree tree) {
+#ifdef _OPENMP
+    bool valid = true;
+    #pragma omp parallel
+    #pragma omp single
+    subtree_check_parallel(tree.root, NO_LOWER_BOUND, NO_UPPER_BOUND,
+                           PARALLEL_VALIDATION_DEPTH, &valid);
+
+    return valid;
+#else
+    return tree_is_valid(tree);
+#endif
+}
+
+Node* node_copy(Pool* pool, Node* source) {
+    Node* copy = (Node*)pool_allocate(pool);
+    *copy = *source;
+
+    return copy;
+}
+
+//Copies the structure of a subtree into the pool without comparing keys.
+//The stacks hold the nodes whose children still have to be copied, and their
+//copies at the same positions
+Node* subtree_copy(Node* source, Pool* pool, Stack* sources, Stack* copies) {
+    if(!source) {
+        return NULL;
+    }
+
+    stack_clear(sources);
+    stack_clear(copies);
+    Node* root = node_copy(pool, source);
+    stack_push(sources, source);
+    stack_push(copies, root);
+    while(!stack_empty(*sources)) {
+        Node* original = stack_pop(sources);
+        Node* copy = stack_pop(copies);
+        if(original->smaller_keys) {
+            copy->smaller_keys = node_copy(pool, original->smaller_keys);
+            stack_push(sources, original->smaller_keys);
+            stack_push(copies, copy->smaller_keys);
+        }
+        if(original->larger_keys) {
+            copy->larger_keys = node_copy(pool, original->larger_keys);
+            stack_push(sources, original->larger_keys);
+            stack_push(copies, copy->larger_keys);
         }
-        move_to_next_level(&t);
     }
 
-    return true;
+    return root;
+}
+
+//Same shape, keys and heights in O(n). Copying many trees with the same
+//scratch only grows its stacks for the first ones
+Tree tree_deep_copy_with_scratch(Tree tree, TraversalScratch* scratch) {
+    TraversalScratch own;
+    TraversalScratch* stacks = traversal_scratch_or_own(scratch, &own);
+    Tree copy = tree_create();
+    copy.root = subtree_copy(tree.root, &copy.nodes, &stacks->nodes,
+                             &stacks->partners);
+    traversal_scratch_delete(&own);
+
+    return copy;
 }
 
-//The iterative traversal uses stacks to remember which nodes to visit.
-//This causes the keys to automatically be in the right order for deep copying
-//the tree structure.
 Tree tree_deep_copy(Tree tree) {
+    return tree_deep_copy_with_scratch(tree, NULL);
+}
+
+//Subtrees with at most this many nodes are copied by one task
+#define PARALLEL_COPY_CUTOFF 65536
+//Bigger subtrees are split further only in the first levels below the root,
+//so the sizes of their roots fit into a table of 2^depth entries
+#define PARALLEL_COPY_DEPTH 12
+
+//The number of nodes in the subtree, visits every node once
+size_t subtree_size(Node* root) {
+    NodePath path;
+    node_path_init(&path);
+    size_t size = 0;
+    Node* current = root;
+    while(current || path.length > 0) {
+        while(current) {
+            node_path_push(&path, current);
+            current = current->smaller_keys;
+        }
+        current = path.nodes[--path.length];
+        ++size;
+        current = current->larger_keys;
+    }
+    node_path_delete(&path);
+
+    return size;
+}
+
+#ifdef _OPENMP
+//What the tasks of a parallel copy need: The sizes of the subtrees in the
+//first levels, the children of entry i are at 2i and 2i + 1, and a pool for
+//every task
+typedef struct {
+    size_t* sizes;
+    Pool* pools;
+    int count;
+} CopyTasks;
+
+//Fills the sizes of the first depth levels, returns the size of the subtree
+size_t subtree_record_sizes(Node* node, size_t* sizes, size_t index,
+                            int depth) {
+    if(!node) {
+        return 0;
+    }
+    if(depth == 0) {
+        return subtree_size(node);
+    }
+
+    size_t size = 1
+                  + subtree_record_sizes(node->smaller_keys, sizes, 2 * index,
+                                         depth - 1)
+                  + subtree_record_sizes(node->larger_keys, sizes,
+                                         2 * index + 1, depth - 1);
+    sizes[index] = size;
+
+    return size;
+}
+
+//Stores the copy of source in *copy. A subtree with at most
+//PARALLEL_COPY_CUTOFF nodes, or below the first levels, is copied by a task
+//into a pool of its own. The roots of bigger subtrees are copied into pool
+//right away, only the thread that spawns the tasks uses it
+void subtree_copy_parallel(Node* source, Node** copy, size_t index,
+                           int depth, Pool* pool, CopyTasks* tasks) {
+    if(!source) {
+        *copy = NULL;
+        return;
+    }
+    if(depth == 0 || tasks->sizes[index] <= PARALLEL_COPY_CUTOFF) {
+        Pool* own = &tasks->pools[tasks->count++];
+        *own = pool_create(sizeof(Node));
+        #pragma omp task firstprivate(source, copy, own)
+        {
+            TraversalScratch scratch = traversal_scratch_create();
+            *copy = subtree_copy(source, own, &scratch.nodes,
+                                 &scratch.partners);
+            traversal_scratch_delete(&scratch);
+        }
+        return;
+    }
+
+    *copy = node_copy(pool, source);
+    subtree_copy_parallel(source->smaller_keys, &(*copy)->smaller_keys,
+                          2 * index, depth - 1, pool, tasks);
+    subtree_copy_parallel(source->larger_keys, &(*copy)->larger_keys,
+                          2 * index + 1, depth - 1, pool, tasks);
+}
+#endif
+
+//Same as tree_deep_copy, but the subtrees are copied by different threads.
+//Counting the sizes first takes one pass over the tree, the pools of the
+//tasks are merged into the copy's when all are done. Without -fopenmp it's
+//tree_deep_copy
+Tree tree_deep_copy_parallel(Tree tree) {
+#ifdef _OPENMP
     Tree copy = tree_create();
-    
-    TreeTraverser t = tree_traverser_create(tree.root);
-    while(!tree_traverser_end_reached(t)) {
-        tree_insert_key(&copy, t.current->key);
-        move_to_next_level(&t);
+    size_t entries = (size_t)1 << PARALLEL_COPY_DEPTH;
+    CopyTasks tasks = {
+        .sizes = (size_t*)malloc(entries * sizeof(size_t)),
+        .pools = (Pool*)malloc(entries * sizeof(Pool)),
+        .count = 0
+    };
+    subtree_record_sizes(tree.root, tasks.sizes, 1, PARALLEL_COPY_DEPTH);
+
+    #pragma omp parallel
+    #pragma omp single
+    {
+        subtree_copy_parallel(tree.root, &copy.root, 1, PARALLEL_COPY_DEPTH,
+                              &copy.nodes, &tasks);
+        #pragma omp taskwait
+    }
+    for(int i = 0; i < tasks.count; ++i) {
+        pool_merge(&copy.nodes, &tasks.pools[i]);
     }
+    free(tasks.sizes);
+    free(tasks.pools);
 
     return copy;
+#else
+    return tree_deep_copy(tree);
+#endif
 }
 
-void tree_delete(Tree* tree) {
-    TreeTraverser t = tree_traverser_create(tree->root);
-    while(!tree_traverser_end_reached(t)) {
-        Node* to_delete = t.current;
-        move_to_next_level(&t);
-        free(to_delete);
+//The number of nodes on the longest path from the root to a leaf, 0 for an
+//empty tree. Works for every tree, goes through it level by level
+int tree_depth(Tree tree) {
+    Stack stacks[2] = {stack_create(), stack_create()};
+    Stack* level = &stacks[0];
+    Stack* next_level = &stacks[1];
+    if(tree.root) {
+        stack_push(level, tree.root);
+    }
+
+    int depth = 0;
+    while(!stack_empty(*level)) {
+        ++depth;
+        while(!stack_empty(*level)) {
+            Node* node = stack_pop(level);
+            if(node->smaller_keys) {
+                stack_push(next_level, node->smaller_keys);
+            }
+            if(node->larger_keys) {
+                stack_push(next_level, node->larger_keys);
+            }
+        }
+        Stack* swap = level;
+        level = next_level;
+        next_level = swap;
     }
+    stack_delete(&stacks[0]);
+    stack_delete(&stacks[1]);
+
+    return depth;
+}
+
+//All nodes live in the pool of the tree, so there is no need to visit them
+void tree_delete(Tree* tree) {
+    pool_destroy(&tree->nodes);
     tree->root = NULL;
 }
 
 //=============================================================================
-//Testing
+//Balanced insertion
 //=============================================================================
 
-void test_tree_is_valid() {
-    Tree tree = tree_create();
-    tree.root = node_create(0);
-    tree.root->larger_keys = node_create(-1);
-    tree.root->smaller_keys = node_create(15);
+//tree_insert_key_balanced keeps the tree an AVL tree: The heights of the two
+//subtrees of every node differ by at most 1, so the depth stays O(log n) even
+//if the keys are inserted sorted. Don't mix it with tree_insert_key on the same
+//tree, because tree_insert_key doesn't maintain the heights
 
-    assert(!tree_is_valid(tree));
+int node_height(Node* node) {
+    return node? node->height : 0;
 }
 
-void test_deep_copy() {
-    Tree tree = tree_create();
-    tree.root = node_create(7);
-    tree.root->larger_keys = node_create(10);
-    tree.root->smaller_keys = node_create(2);
-    tree.root->smaller_keys->larger_keys = node_create(5);
-    tree.root->smaller_keys->larger_keys->smaller_keys = node_create(3);
-    tree.root->larger_keys->larger_keys = node_create(15);
+void node_update_height(Node* node) {
+    int smaller = node_height(node->smaller_keys);
+    int larger = node_height(node->larger_keys);
+    node->height = (smaller > larger? smaller : larger) + 1;
+}
 
-    Tree copy = tree_deep_copy(tree);
+//Returns the new root of the subtree, the old root's left child
+Node* node_rotate_right(Node* node) {
+    Node* new_root = node->smaller_keys;
+    node->smaller_keys = new_root->larger_keys;
+    new_root->larger_keys = node;
+    node_update_height(node);
+    node_update_height(new_root);
 
-    assert(tree.root->key == 7);
-    assert(tree.root->larger_keys->key == 10);
-    assert(tree.root->smaller_keys->key == 2);
-    assert(tree.root->smaller_keys->larger_keys->key == 5);
-    assert(tree.root->smaller_keys->larger_keys->smaller_keys->key == 3);
-    assert(tree.root->larger_keys->larger_keys->key == 15);
+    return new_root;
+}
 
-    tree_delete(&copy);
-    tree_delete(&tree);
+//Returns the new root of the subtree, the old root's right child
+Node* node_rotate_left(Node* node) {
+    Node* new_root = node->larger_keys;
+    node->larger_keys = new_root->smaller_keys;
+    new_root->smaller_keys = node;
+    node_update_height(node);
+    node_update_height(new_root);
+
+    return new_root;
 }
 
-void test_insertion_and_deletion() {
-    Tree tree = tree_create();
-    assert(tree_is_valid(tree));
+//Restores the AVL property of a node whose subtrees are AVL trees and differ
+//in height by at most 2. Returns the new root of the subtree
+Node* node_rebalance(Node* node) {
+    node_update_height(node);
+    int balance = node_height(node->smaller_keys)
+                  - node_height(node->larger_keys);
 
-    const int SIZE = 100;
+    if(balance > 1) {
+        Node* smaller = node->smaller_keys;
+        if(node_height(smaller->smaller_keys)
+           < node_height(smaller->larger_keys)) {
+            node->smaller_keys = node_rotate_left(smaller);
+        }
+        return node_rotate_right(node);
+    }
+    if(balance < -1) {
+        Node* larger = node->larger_keys;
+        if(node_height(larger->larger_keys)
+           < node_height(larger->smaller_keys)) {
+            node->larger_keys = node_rotate_right(larger);
+        }
+        return node_rotate_left(node);
+    }
 
-    Node* nodes[SIZE];
-    for(int i = 0; i < SIZE; ++i) {
-        int value = rand() % (SIZE*100);
-        nodes[i] = tree_insert_key(&tree, value);
-        if(nodes[i] == NULL) { //Duplicate entry
-            --i; //Try again
+    return node;
+}
+
+//Same contract as tree_insert_key: Returns the new node or NULL if the key is
+//already in the tree. Mechanism: Go down like tree_insert_key and remember the
+//path, then walk it back up and rebalance. Once a subtree has the same height
+//as before the insertion, nothing above it changes
+Node* tree_insert_key_balanced(Tree* tree, int key) {
+    NodePath path;
+    node_path_init(&path);
+    Node* current = tree->root;
+    while(current) {
+        if(key == current->key) {
+            node_path_delete(&path);
+            return NULL; //Ignore duplicates
         }
+        node_path_push(&path, current);
+        current = key < current->key? current->smaller_keys
+                                    : current->larger_keys;
     }
-    assert(tree_is_valid(tree));
 
-    //Test finding keys iteratively and recursively
-    Tree copy = tree_deep_copy(tree);
-    for(int i = 0; i < SIZE; ++i) {
-        assert(tree_find_key_iterative(tree, nodes[i]->key));
-        assert(tree_find_key_recursive(tree, nodes[i]->key));
-        assert(tree_find_key_iterative(copy, nodes[i]->key));
+    Node* new_node = node_create(tree, key);
+    Node* subtree = new_node;
+    bool height_changed = true;
+    while(path.length > 0) {
+        Node* parent = path.nodes[--path.length];
+        if(key < parent->key) {
+            parent->smaller_keys = subtree;
+        }
+        else {
+            parent->larger_keys = subtree;
+        }
+        if(!height_changed) {
+            node_path_delete(&path);
+            return new_node;
+        }
+
+        int old_height = parent->height;
+        subtree = node_rebalance(parent);
+        height_changed = subtree->height != old_height;
     }
+    tree->root = subtree;
+    node_path_delete(&path);
 
-    tree_delete(&copy);
-    for(int i = 0; i < SIZE; ++i) {
-        assert(tree_find_key_iterative(tree, nodes[i]->key));
-        assert(!tree_find_key_iterative(copy, nodes[i]->key));
+    return new_node;
+}
+
+//=============================================================================
+//Building from sorted keys
+//=============================================================================
+
+//Links nodes[first..last) into a perfectly balanced subtree and returns its
+//root. nodes[i] gets keys[i], the middle key of every range becomes the root
+//of its subtree. Every node is visited once
+Node* link_sorted(Node* nodes, int* keys, size_t first, size_t last) {
+    if(first == last) {
+        return NULL;
     }
-    tree_delete(&tree);
-    assert(tree.root == NULL);
+
+    size_t middle = first + (last - first) / 2;
+    Node* node = &nodes[middle];
+    node->key = keys[middle];
+    node->smaller_keys = link_sorted(nodes, keys, first, middle);
+    node->larger_keys = link_sorted(nodes, keys, middle + 1, last);
+    node_update_height(node);
+
+    return node;
+}
+
+//Puts all nodes into one contiguous block of the tree's pool
+Tree tree_create_for_sorted(int* keys, size_t n, Node** nodes) {
+    for(size_t i = 1; i < n; ++i) {
+        assert(keys[i - 1] < keys[i]); //Sorted and without duplicates
+    }
+
+    Tree tree = tree_create();
+    *nodes = n > 0? (Node*)pool_allocate_array(&tree.nodes, n) : NULL;
+
+    return tree;
+}
+
+//Builds a perfectly balanced tree from sorted keys without duplicates in O(n).
+//The heights are set, so tree_insert_key_balanced can be used afterwards
+Tree tree_build_from_sorted(int* keys, size_t n) {
+    Node* nodes;
+    Tree tree = tree_create_for_sorted(keys, n, &nodes);
+    tree.root = link_sorted(nodes, keys, 0, n);
+
+    return tree;
+}
+
+//Ranges smaller than this are linked by one thread, a task has to be worth it
+#define PARALLEL_BUILD_CUTOFF 65536
+
+#ifdef _OPENMP
+Node* link_sorted_parallel(Node* nodes, int* keys, size_t first, size_t last) {
+    if(last - first <= PARALLEL_BUILD_CUTOFF) {
+        return link_sorted(nodes, keys, first, last);
+    }
+
+    size_t middle = first + (last - first) / 2;
+    Node* node = &nodes[middle];
+    node->key = keys[middle];
+    #pragma omp task firstprivate(node)
+    node->smaller_keys = link_sorted_parallel(nodes, keys, first, middle);
+    node->larger_keys = link_sorted_parallel(nodes, keys, middle + 1, last);
+    #pragma omp taskwait
+    node_update_height(node);
+
+    return node;
+}
+#endif
+
+//Same tree as tree_build_from_sorted, but the two halves of every big range are
+//linked by different threads. Without -fopenmp it's tree_build_from_sorted
+Tree tree_build_from_sorted_parallel(int* keys, size_t n) {
+    Node* nodes;
+    Tree tree = tree_create_for_sorted(keys, n, &nodes);
+#ifdef _OPENMP
+    #pragma omp parallel
+    #pragma omp single
+    tree.root = link_sorted_parallel(nodes, keys, 0, n);
+#else
+    tree.root = link_sorted(nodes, keys, 0, n);
+#endif
+
+    return tree;
 }
 
-int main() {
+//=============================================================================
+//Static search indices
+//=============================================================================
+
+//Every lookup in the tree follows pointers to nodes all over the memory, which
+//costs a cache miss per level. A tree that doesn't change anymore can be
+//frozen into an index that keeps the keys of a lookup close together
+
+//Returns the keys of the tree in ascending order, n is set to their number
+int* tree_sorted_keys(Tree tree, size_t* n) {
+    size_t capacity = 1024;
+    int* keys = (int*)malloc(capacity * sizeof(int));
+    *n = 0;
+
+    //In-order traversal: Go left as far as possible, then visit the node and
+    //continue with its right subtree
+    Stack stack = stack_create();
+    Node* current = tree.root;
+    while(current || !stack_empty(stack)) {
+        while(current) {
+            stack_push(&stack, current);
+            current = current->smaller_keys;
+        }
+        current = stack_pop(&stack);
+        if(*n == capacity) {
+            capacity *= 2;
+            keys = (int*)realloc(keys, capacity * sizeof(int));
+        }
+        keys[(*n)++] = current->key;
+        current = current->larger_keys;
+    }
+    stack_delete(&stack);
+
+    return keys;
+}
+
+#define CACHE_LINE_SIZE 64
+
+//aligned_alloc needs a multiple of the alignment
+void* cache_aligned_alloc(size_t bytes) {
+    size_t lines = (bytes + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
+    if(lines == 0) {
+        lines = 1;
+    }
+
+    return aligned_alloc(CACHE_LINE_SIZE, lines * CACHE_LINE_SIZE);
+}
+
+//Eytzinger layout: The keys of the tree in breadth first order, the children
+//of keys[k] are keys[2k] and keys[2k + 1]. keys[0] is unused. The first levels
+//share a few cache lines and the 16 descendants four levels below keys[k] are
+//next to each other, so they can be prefetched
+typedef struct {
+    int* keys;
+    size_t n;
+} EytzingerIndex;
+
+//Fills the subtree of k with sorted[i..], returns the next unused i
+size_t eytzinger_fill(EytzingerIndex* index, int* sorted, size_t i, size_t k) {
+    if(k <= index->n) {
+        i = eytzinger_fill(index, sorted, i, 2*k);
+        index->keys[k] = sorted[i++];
+        i = eytzinger_fill(index, sorted, i, 2*k + 1);
+    }
+
+    return i;
+}
+
+EytzingerIndex eytzinger_create(Tree tree) {
+    EytzingerIndex index;
+    int* sorted = tree_sorted_keys(tree, &index.n);
+    index.keys = (int*)cache_aligned_alloc((index.n + 1) * sizeof(int));
+    eytzinger_fill(&index, sorted, 0, 1);
+    free(sorted);
+
+    return index;
+}
+
+void eytzinger_delete(EytzingerIndex* index) {
+    free(index->keys);
+    index->keys = NULL;
+    index->n = 0;
+}
+
+//Mechanism: Go down without branching on the comparison, k collects the turns
+//as bits (1 = right). In the end, the right turns after the last left turn are
+//removed, which leads to the smallest key >= key
+bool eytzinger_find_key(EytzingerIndex index, int key) {
+    size_t k = 1;
+    while(k <= index.n) {
+        __builtin_prefetch(index.keys + 16*k); //Four levels below
+        k = 2*k + (index.keys[k] < key);
+    }
+    k >>= __builtin_ffsll(~(long long)k);
+
+    return k > 0 && index.keys[k] == key;
+}
+
+//B+-tree layout: The sorted keys in blocks of one cache line, padded with
+//INT_MAX. Each level above has one key per block of the level below, its
+//biggest one, so block j of a level points to blocks 16j..16j+15 below it.
+//A lookup reads one cache line per level
+#define BTREE_BLOCK_SIZE (CACHE_LINE_SIZE / (int)sizeof(int))
+#define BTREE_MAX_LEVELS 16
+
+typedef struct {
+    int* keys;
+    size_t n;
+    int levels;
+    size_t level_offsets[BTREE_MAX_LEVELS]; //Level 0 are the sorted keys
+} BTreeIndex;
+
+BTreeIndex btree_create(Tree tree) {
+    BTreeIndex index;
+    int* sorted = tree_sorted_keys(tree, &index.n);
+    size_t n = index.n;
+
+    size_t blocks[BTREE_MAX_LEVELS];
+    size_t total_blocks = 0;
+    index.levels = 0;
+    do {
+        size_t below = index.levels == 0? n : blocks[index.levels - 1];
+        blocks[index.levels] = (below + BTREE_BLOCK_SIZE - 1)
+                               / BTREE_BLOCK_SIZE;
+        if(blocks[index.levels] == 0) {
+            blocks[index.levels] = 1;
+        }
+        index.level_offsets[index.levels] = total_blocks * BTREE_BLOCK_SIZE;
+        total_blocks += blocks[index.levels];
+        ++index.levels;
+    } while(blocks[index.levels - 1] > 1);
+
+    index.keys = (int*)cache_aligned_alloc(total_blocks * CACHE_LINE_SIZE);
+    for(size_t i = 0; i < total_blocks * BTREE_BLOCK_SIZE; ++i) {
+        index.keys[i] = INT_MAX;
+    }
+    memcpy(index.keys, sorted, n * sizeof(int));
+    for(int level = 1; level < index.levels; ++level) {
+        int* below = index.keys + index.level_offsets[level - 1];
+        int* keys = index.keys + index.level_offsets[level];
+        for(size_t j = 0; j < blocks[level - 1]; ++j) {
+            keys[j] = below[j*BTREE_BLOCK_SIZE + BTREE_BLOCK_SIZE - 1];
+        }
+    }
+    free(sorted);
+
+    return index;
+}
+
+void btree_delete(BTreeIndex* index) {
+    free(index->keys);
+    index->keys = NULL;
+    index->n = 0;
+    index->levels = 0;
+}
+
+//The number of keys in a block that are smaller than key. Without branches,
+//so the compiler can do all 16 comparisons at once
+int btree_rank_in_block(int* block, int key) {
+    int rank = 0;
+    for(int i = 0; i < BTREE_BLOCK_SIZE; ++i) {
+        rank += block[i] < key;
+    }
+
+    return rank;
+}
+
+bool btree_find_key(BTreeIndex index, int key) {
+    size_t block = 0;
+    for(int level = index.levels - 1; level >= 0; --level) {
+        int* keys = index.keys + index.level_offsets[level];
+        int rank = btree_rank_in_block(keys + block*BTREE_BLOCK_SIZE, key);
+        if(rank == BTREE_BLOCK_SIZE) {
+            return false; //Bigger than every key
+        }
+        block = block*BTREE_BLOCK_SIZE + rank;
+    }
+
+    //block is now the position of the smallest key >= key in level 0, it
+    //may be padding if key is INT_MAX
+    return block < index.n && index.keys[block] == key;
+}
+
+//=============================================================================
+//Concurrent tree
+//=============================================================================
+
+//A tree that many threads can search and insert into at the same time. Keys
+//are never removed, so a node stays where it is once it's linked into the
+//tree. That makes the lookups lock-free: They just follow the child pointers,
+//which are read with acquire and written with release, so a linked node is
+//always seen completely initialized. Insertions link a new node with a
+//compare and swap on the empty child pointer, and if another thread was
+//faster, continue from the node it linked.
+//No node is freed while the tree is in use, so readers never need epochs or
+//hazard pointers; all memory is given back by concurrent_tree_delete.
+//Like tree_insert_key, sorted keys make it a list, there is no rebalancing
+typedef struct CONCURRENT_NODE ConcurrentNode;
+
+struct CONCURRENT_NODE {
+    int key;
+    _Atomic(ConcurrentNode*) smaller_keys;
+    _Atomic(ConcurrentNode*) larger_keys;
+};
+
+typedef struct {
+    _Atomic(ConcurrentNode*) root;
+    Pool nodes; //The pools of the writers that are done, see below
+    atomic_flag nodes_lock;
+} ConcurrentTree;
+
+//Every inserting thread has a writer, its nodes come from the writer's pool,
+//so allocating needs no lock. When the thread is done, the pool goes to the
+//tree
+typedef struct {
+    ConcurrentTree* tree;
+    Pool nodes;
+} ConcurrentWriter;
+
+void concurrent_tree_init(ConcurrentTree* tree) {
+    atomic_init(&tree->root, NULL);
+    tree->nodes = pool_create(sizeof(ConcurrentNode));
+    atomic_flag_clear(&tree->nodes_lock);
+}
+
+ConcurrentWriter concurrent_writer_create(ConcurrentTree* tree) {
+    ConcurrentWriter writer = {
+        .tree = tree,
+        .nodes = pool_create(sizeof(ConcurrentNode))
+    };
+
+    return writer;
+}
+
+//The nodes of the writer stay in the tree
+void concurrent_writer_delete(ConcurrentWriter* writer) {
+    ConcurrentTree* tree = writer->tree;
+    while(atomic_flag_test_and_set_explicit(&tree->nodes_lock,
+                                            memory_order_acquire)) {
+        //Only writers that are done wait here, and only for a pool_merge
+    }
+    pool_merge(&tree->nodes, &writer->nodes);
+    atomic_flag_clear_explicit(&tree->nodes_lock, memory_order_release);
+}
+
+//Like tree_find_key_iterative, can be called by any thread at any time
+ConcurrentNode* concurrent_tree_find_key(ConcurrentTree* tree, int key) {
+    ConcurrentNode* current = atomic_load_explicit(&tree->root,
+                                                   memory_order_acquire);
+    while(current) {
+        if(current->key == key) {
+            return current;
+        }
+        current = atomic_load_explicit(key > current->key
+                                       ? &current->larger_keys
+                                       : &current->smaller_keys,
+                                       memory_order_acquire);
+    }
+
+    return NULL;
+}
+
+//Like tree_insert_key: Returns the new node or NULL if the key is already in
+//the tree, also if another thread inserted it first
+ConcurrentNode* concurrent_tree_insert_key(ConcurrentWriter* writer, int key) {
+    ConcurrentNode* new_node = NULL;
+    _Atomic(ConcurrentNode*)* slot = &writer->tree->root;
+    while(true) {
+        ConcurrentNode* current = atomic_load_explicit(slot,
+                                                       memory_order_acquire);
+        if(!current) {
+            if(!new_node) {
+                new_node = (ConcurrentNode*)pool_allocate(&writer->nodes);
+                new_node->key = key;
+                atomic_init(&new_node->smaller_keys, NULL);
+                atomic_init(&new_node->larger_keys, NULL);
+            }
+            if(atomic_compare_exchange_strong_explicit(slot, &current,
+                                                       new_node,
+                                                       memory_order_release,
+                                                       memory_order_acquire)) {
+                return new_node;
+            }
+            //Another thread linked a node here, current is that one now
+        }
+
+        if(key == current->key) {
+            if(new_node) {
+                pool_free(&writer->nodes, new_node);
+            }
+            return NULL; //Ignore duplicates
+        }
+        slot = key < current->key? &current->smaller_keys
+                                 : &current->larger_keys;
+    }
+}
+
+//No thread may use the tree anymore and all writers must be deleted
+void concurrent_tree_delete(ConcurrentTree* tree) {
+    pool_destroy(&tree->nodes);
+    atomic_store(&tree->root, NULL);
+}
+
+int thread_number() {
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+//=============================================================================
+//Persistent tree
+//=============================================================================
+
+//Versions of an AVL tree that share their unchanged subtrees. An insertion
+//copies only the nodes on the path to the new key, every other subtree is
+//shared with the old version. So a snapshot is just another reference to the
+//root, and a version never changes once it has been snapshotted.
+//The nodes count how many parents and versions point to them, a node is freed
+//when the last one is gone. They are Nodes with the count appended, so the
+//lookups and checks of Tree work on them, see persistent_tree_view.
+//Threads: One PersistentTree may only be used by one thread at a time, but
+//different versions can be read, inserted into and deleted on different
+//threads at once, e.g. readers that drop their snapshots while the original
+//keeps changing. The counts are atomic and the store has a lock. A snapshot
+//has to be handed to another thread like any other data, e.g. before the
+//thread starts or through a mutex
+typedef struct {
+    Node node; //Must be the first member
+    atomic_int references;
+} PersistentNode;
+
+//All versions of one tree take their nodes from the same store
+typedef struct {
+    Pool nodes;
+    size_t live_nodes;
+    atomic_flag lock; //For nodes and live_nodes
+} PersistentStore;
+
+typedef struct {
+    PersistentStore* store;
+    Node* root;
+} PersistentTree;
+
+void persistent_store_init(PersistentStore* store) {
+    store->nodes = pool_create(sizeof(PersistentNode));
+    store->live_nodes = 0;
+    atomic_flag_clear(&store->lock);
+}
+
+void persistent_store_lock(PersistentStore* store) {
+    while(atomic_flag_test_and_set_explicit(&store->lock,
+                                            memory_order_acquire)) {
+        //Held only for a pool_allocate or pool_free
+    }
+}
+
+void persistent_store_unlock(PersistentStore* store) {
+    atomic_flag_clear_explicit(&store->lock, memory_order_release);
+}
+
+//Frees the nodes of all versions at once, none of them may be used anymore
+void persistent_store_delete(PersistentStore* store) {
+    pool_destroy(&store->nodes);
+    store->live_nodes = 0;
+}
+
+PersistentTree persistent_tree_create(PersistentStore* store) {
+    PersistentTree tree = {
+        .store = store,
+        .root = NULL
+    };
+
+    return tree;
+}
+
+//A Tree to use tree_find_key_iterative, tree_is_valid, tree_depth, ... with.
+//It must not be changed or deleted
+Tree persistent_tree_view(PersistentTree tree) {
+    Tree view = {
+        .root = tree.root,
+        .nodes = {.element_size = 0, .chunks = NULL, .free_list = NULL}
+    };
+
+    return view;
+}
+
+atomic_int* persistent_references(Node* node) {
+    return &((PersistentNode*)node)->references;
+}
+
+//Whoever takes a reference already holds one to the node or its parent, so
+//the node can't be freed meanwhile and no ordering is needed
+void persistent_node_acquire(Node* node) {
+    if(node) {
+        atomic_fetch_add_explicit(persistent_references(node), 1,
+                                  memory_order_relaxed);
+    }
+}
+
+//Frees the node if this was the last reference, and then gives up its
+//references to its children. acq_rel: The thread that frees the node sees
+//everything the other owners did with it before they let go
+void persistent_node_release(PersistentStore* store, Node* node) {
+    if(!node || atomic_fetch_sub_explicit(persistent_references(node), 1,
+                                          memory_order_acq_rel) > 1) {
+        return;
+    }
+
+    persistent_node_release(store, node->smaller_keys);
+    persistent_node_release(store, node->larger_keys);
+    persistent_store_lock(store);
+    pool_free(&store->nodes, node);
+    --store->live_nodes;
+    persistent_store_unlock(store);
+}
+
+//A copy with one reference that shares the children of the original
+Node* persistent_node_copy(PersistentStore* store, Node* original) {
+    persistent_store_lock(store);
+    PersistentNode* copy = (PersistentNode*)pool_allocate(&store->nodes);
+    ++store->live_nodes;
+    persistent_store_unlock(store);
+    copy->node = *original;
+    atomic_init(&copy->references, 1);
+    persistent_node_acquire(original->smaller_keys);
+    persistent_node_acquire(original->larger_keys);
+
+    return &copy->node;
+}
+
+//O(1), the snapshot and the tree share all nodes. Both have to be deleted
+PersistentTree persistent_tree_snapshot(PersistentTree tree) {
+    persistent_node_acquire(tree.root);
+
+    return tree;
+}
+
+void persistent_tree_delete(PersistentTree* tree) {
+    persistent_node_release(tree->store, tree->root);
+    tree->root = NULL;
+}
+
+//Like tree_insert_key_balanced, but this version gets a new root and the old
+//nodes stay as they are for the other versions. Mechanism: Go down and
+//remember the path, then copy it bottom up. The copies belong to this version
+//only, so rebalancing may change them; the rotations of an insertion only
+//move nodes on the path
+Node* persistent_tree_insert_key(PersistentTree* tree, int key) {
+    NodePath path;
+    node_path_init(&path);
+    Node* current = tree->root;
+    while(current) {
+        if(key == current->key) {
+            node_path_delete(&path);
+            return NULL; //Ignore duplicates
+        }
+        node_path_push(&path, current);
+        current = key < current->key? current->smaller_keys
+                                    : current->larger_keys;
+    }
+
+    Node leaf = {
+        .key = key,
+        .height = 1,
+        .smaller_keys = NULL,
+        .larger_keys = NULL
+    };
+    Node* new_node = persistent_node_copy(tree->store, &leaf);
+    Node* subtree = new_node;
+    while(path.length > 0) {
+        Node* original = path.nodes[--path.length];
+        Node* copy = persistent_node_copy(tree->store, original);
+        //The copy points to the new subtree instead of the old one
+        if(key < copy->key) {
+            persistent_node_release(tree->store, copy->smaller_keys);
+            copy->smaller_keys = subtree;
+        }
+        else {
+            persistent_node_release(tree->store, copy->larger_keys);
+            copy->larger_keys = subtree;
+        }
+        subtree = node_rebalance(copy);
+    }
+    node_path_delete(&path);
+
+    persistent_node_release(tree->store, tree->root);
+    tree->root = subtree;
+
+    return new_node;
+}
+
+//=============================================================================
+//Testing
+//=============================================================================
+
+void test_tree_is_valid() {
+    Tree tree = tree_create();
+    tree.root = node_create(&tree, 0);
+    tree.root->larger_keys = node_create(&tree, -1);
+    tree.root->smaller_keys = node_create(&tree, 15);
+
+    assert(!tree_is_valid(tree));
+    assert(!tree_is_valid_parallel(tree));
+    tree_delete(&tree);
+
+    //The violation is two levels down: 12 is in the left subtree of 10
+    tree = tree_create();
+    tree.root = node_create(&tree, 10);
+    tree.root->smaller_keys = node_create(&tree, 5);
+    tree.root->smaller_keys->larger_keys = node_create(&tree, 12);
+    tree.root->larger_keys = node_create(&tree, 20);
+    assert(!tree_is_valid(tree));
+    assert(!tree_is_valid_parallel(tree));
+    tree.root->smaller_keys->larger_keys->key = 7;
+    assert(tree_is_valid(tree));
+    assert(tree_is_valid_parallel(tree));
+    tree.root->key = INT_MAX; //Extreme keys are fine
+    tree.root->larger_keys->key = INT_MIN;
+    assert(!tree_is_valid(tree));
+    tree.root->larger_keys = NULL;
+    assert(tree_is_valid(tree));
+    tree_delete(&tree);
+
+    //A big tree, once with a duplicate deep inside
+    const int SIZE = 100000;
+    int* keys = (int*)malloc(SIZE * sizeof(int));
+    for(int i = 0; i < SIZE; ++i) {
+        keys[i] = i;
+    }
+    tree = tree_build_from_sorted(keys, SIZE);
+    assert(tree_is_valid(tree) && tree_is_valid_parallel(tree));
+    Node* node = tree_find_key_iterative(tree, 4321);
+    node->key = 4322;
+    assert(!tree_is_valid(tree) && !tree_is_valid_parallel(tree));
+    node->key = 4321;
+    assert(tree_is_valid(tree) && tree_is_valid_parallel(tree));
+    tree_delete(&tree);
+    free(keys);
+
+    //A list deeper than AVL_MAX_DEPTH, the path moves to the heap
+    tree = tree_create();
+    for(int i = 0; i < 1000; ++i) {
+        tree_insert_key(&tree, i);
+    }
+    assert(tree_is_valid(tree) && tree_is_valid_parallel(tree));
+    node = tree_find_key_iterative(tree, 900);
+    node->key = 100;
+    assert(!tree_is_valid(tree) && !tree_is_valid_parallel(tree));
+    tree_delete(&tree);
+}
+
+bool _same_shape(Node* a, Node* b) {
+    if(!a || !b) {
+        return a == b;
+    }
+
+    return a->key == b->key && a->height == b->height
+           && _same_shape(a->smaller_keys, b->smaller_keys)
+           && _same_shape(a->larger_keys, b->larger_keys);
+}
+
+void test_deep_copy() {
+    Tree tree = tree_create();
+    tree.root = node_create(&tree, 7);
+    tree.root->larger_keys = node_create(&tree, 10);
+    tree.root->smaller_keys = node_create(&tree, 2);
+    tree.root->smaller_keys->larger_keys = node_create(&tree, 5);
+    tree.root->smaller_keys->larger_keys->smaller_keys = node_create(&tree, 3);
+    tree.root->larger_keys->larger_keys = node_create(&tree, 15);
+
+    Tree copy = tree_deep_copy(tree);
+
+    assert(tree.root->key == 7);
+    assert(tree.root->larger_keys->key == 10);
+    assert(tree.root->smaller_keys->key == 2);
+    assert(tree.root->smaller_keys->larger_keys->key == 5);
+    assert(tree.root->smaller_keys->larger_keys->smaller_keys->key == 3);
+    assert(tree.root->larger_keys->larger_keys->key == 15);
+
+    assert(_same_shape(tree.root, copy.root));
+    copy.root->smaller_keys->key = 1; //The copy has nodes of its own
+    assert(tree.root->smaller_keys->key == 2);
+
+    tree_delete(&copy);
+    tree_delete(&tree);
+
+    //Big trees, random and balanced
+    tree = tree_create();
+    for(int i = 0; i < 100000; ++i) {
+        tree_insert_key(&tree, rand());
+    }
+    for(int round = 0; round < 2; ++round) {
+        copy = tree_deep_copy(tree);
+        Tree parallel_copy = tree_deep_copy_parallel(tree);
+        assert(_same_shape(tree.root, copy.root));
+        assert(_same_shape(tree.root, parallel_copy.root));
+        tree_delete(&tree);
+        assert(tree_is_valid(parallel_copy));
+
+        //Copies of copies, and insertions into a copy with merged pools
+        tree = tree_deep_copy_parallel(parallel_copy);
+        for(int i = 0; i < 1000; ++i) {
+            tree_insert_key(&parallel_copy, rand());
+        }
+        assert(tree_is_valid(parallel_copy));
+        tree_delete(&parallel_copy);
+        tree_delete(&copy);
+    }
+    tree_delete(&tree);
+
+    Tree empty = tree_create();
+    copy = tree_deep_copy_parallel(empty);
+    assert(copy.root == NULL);
+
+    //A list: Below the first levels, one task copies the rest however big
+    tree = tree_create();
+    Node** next = &tree.root;
+    for(int i = 0; i < 100000; ++i) {
+        *next = node_create(&tree, i);
+        next = &(*next)->larger_keys;
+    }
+    copy = tree_deep_copy_parallel(tree);
+    assert(tree_is_valid(copy) && subtree_size(copy.root) == 100000);
+    assert(tree_find_key_iterative(copy, 99999)->key == 99999);
+    assert(tree_find_key_iterative(copy, 99999)
+           != tree_find_key_iterative(tree, 99999));
+    tree_delete(&copy);
+    tree_delete(&tree);
+}
+
+void test_insertion_and_deletion() {
+    Tree tree = tree_create();
+    assert(tree_is_valid(tree));
+
+    const int SIZE = 100;
+
+    Node* nodes[SIZE];
+    for(int i = 0; i < SIZE; ++i) {
+        int value = rand() % (SIZE*100);
+        nodes[i] = tree_insert_key(&tree, value);
+        if(nodes[i] == NULL) { //Duplicate entry
+            --i; //Try again
+        }
+    }
+    assert(tree_is_valid(tree));
+
+    //Test finding keys iteratively and recursively
+    Tree copy = tree_deep_copy(tree);
+    for(int i = 0; i < SIZE; ++i) {
+        assert(tree_find_key_iterative(tree, nodes[i]->key));
+        assert(tree_find_key_recursive(tree, nodes[i]->key));
+        assert(tree_find_key_iterative(copy, nodes[i]->key));
+    }
+
+    //The same lookups as a batch, plus keys that aren't in the tree
+    int keys[2*SIZE];
+    Node* found[2*SIZE];
+    for(int i = 0; i < SIZE; ++i) {
+        keys[2*i] = nodes[i]->key;
+        keys[2*i + 1] = -1 - i;
+    }
+    tree_find_keys_batch(tree, keys, 2*SIZE, found);
+    for(int i = 0; i < SIZE; ++i) {
+        assert(found[2*i] == nodes[i]);
+        assert(found[2*i + 1] == NULL);
+    }
+    tree_find_keys_batch(copy, keys, 0, found); //Nothing to do
+    Tree empty = tree_create();
+    tree_find_keys_batch(empty, keys, 2*SIZE, found);
+    for(int i = 0; i < 2*SIZE; ++i) {
+        assert(found[i] == NULL);
+    }
+
+    tree_delete(&copy);
+    for(int i = 0; i < SIZE; ++i) {
+        assert(tree_find_key_iterative(tree, nodes[i]->key));
+        assert(!tree_find_key_iterative(copy, nodes[i]->key));
+    }
+    tree_delete(&tree);
+    assert(tree.root == NULL);
+}
+
+void test_stack_and_scratch() {
+    Stack stack = stack_create();
+    Node nodes[1000];
+    for(int i = 0; i < 1000; ++i) {
+        stack_push(&stack, &nodes[i]);
+    }
+    assert(stack.capacity >= 1000);
+    for(int i = 999; i >= 0; --i) {
+        assert(stack_pop(&stack) == &nodes[i]);
+    }
+    assert(stack_empty(stack));
+    stack_delete(&stack);
+
+    //Copies with the same scratch don't need to grow the stacks again
+    Tree tree = tree_create();
+    for(int i = 0; i < 1000; ++i) {
+        tree_insert_key(&tree, (int)((i * 7919L) % 1009));
+    }
+    TraversalScratch scratch = traversal_scratch_create();
+    size_t capacities[2];
+    for(int round = 0; round < 2; ++round) {
+        Tree copy = tree_deep_copy_with_scratch(tree, &scratch);
+        assert(_same_shape(tree.root, copy.root));
+        tree_delete(&copy);
+        if(round == 0) {
+            capacities[0] = scratch.nodes.capacity;
+            capacities[1] = scratch.partners.capacity;
+        }
+    }
+    assert(scratch.nodes.capacity == capacities[0]);
+    assert(scratch.partners.capacity == capacities[1]);
+    traversal_scratch_delete(&scratch);
+    tree_delete(&tree);
+}
+
+//Checks the heights and the AVL property of every node, returns the height
+int _check_avl(Node* node) {
+    if(!node) {
+        return 0;
+    }
+    int smaller = _check_avl(node->smaller_keys);
+    int larger = _check_avl(node->larger_keys);
+    assert(smaller - larger <= 1 && larger - smaller <= 1);
+    assert(node->height == (smaller > larger? smaller : larger) + 1);
+
+    return node->height;
+}
+
+void test_balanced_insertion() {
+    const int SIZE = 100000;
+
+    //Sorted keys turn the unbalanced tree into a list
+    Tree unbalanced = tree_create();
+    for(int i = 0; i < 1000; ++i) {
+        tree_insert_key(&unbalanced, i);
+    }
+    assert(tree_depth(unbalanced) == 1000);
+    //Balanced insertion still works there, the path is longer than
+    //AVL_MAX_DEPTH and moves to the heap
+    assert(tree_insert_key_balanced(&unbalanced, 1000)->key == 1000);
+    assert(tree_insert_key_balanced(&unbalanced, 999) == NULL);
+    assert(tree_is_valid(unbalanced));
+    assert(tree_find_key_iterative(unbalanced, 1000));
+    tree_delete(&unbalanced);
+
+    //Sorted, reversed and zigzag orders, an AVL tree with n nodes is never
+    //deeper than 1.44*log2(n + 2)
+    for(int order = 0; order < 3; ++order) {
+        Tree tree = tree_create();
+        assert(tree_depth(tree) == 0);
+        for(int i = 0; i < SIZE; ++i) {
+            int key = order == 0? i : order == 1? SIZE - i
+                    : (i % 2? i : -i);
+            assert(tree_insert_key_balanced(&tree, key)->key == key);
+            assert(tree_insert_key_balanced(&tree, key) == NULL);
+        }
+        assert(tree_depth(tree) <= 24);
+        assert(tree_depth(tree) == _check_avl(tree.root));
+        assert(tree_find_key_iterative(tree, order == 1? SIZE : 0));
+        assert(!tree_find_key_iterative(tree, SIZE + 1));
+
+        //The copy has the same shape and heights
+        Tree copy = tree_deep_copy(tree);
+        assert(tree_depth(copy) == tree_depth(tree));
+        _check_avl(copy.root);
+        tree_delete(&copy);
+        tree_delete(&tree);
+    }
+
+    Tree tree = tree_create();
+    for(int i = 0; i < 1000; ++i) {
+        tree_insert_key_balanced(&tree, rand() % 500);
+    }
+    assert(tree_is_valid(tree));
+    _check_avl(tree.root);
+    tree_delete(&tree);
+    //Independent trees on different threads don't share anything
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(4)
+#endif
+    {
+        Tree own = tree_create();
+        for(int i = 0; i < 20000; ++i) {
+            tree_insert_key_balanced(&own, i * (thread_number() + 1));
+        }
+        assert(tree_depth(own) <= 16);
+        assert(tree_is_valid(own));
+        _check_avl(own.root);
+        tree_delete(&own);
+    }
+}
+
+void test_build_from_sorted() {
+    const int SIZE = 300000;
+    int* keys = (int*)malloc(SIZE * sizeof(int));
+    for(int i = 0; i < SIZE; ++i) {
+        keys[i] = 3*i - SIZE;
+    }
+
+    int sizes[] = {0, 1, 2, 3, 7, 8, 1000, SIZE};
+    for(int s = 0; s < 8; ++s) {
+        int n = sizes[s];
+        Tree tree = tree_build_from_sorted(keys, n);
+        int depth = 0;
+        while((1 << depth) <= n) {
+            ++depth;
+        }
+        assert(tree_depth(tree) == depth); //floor(log2(n)) + 1
+        assert(tree_is_valid(tree));
+        _check_avl(tree.root);
+        for(int i = 0; i < n; i += 97) {
+            assert(tree_find_key_iterative(tree, keys[i]));
+            assert(!tree_find_key_iterative(tree, keys[i] + 1));
+        }
+
+        Tree parallel = tree_build_from_sorted_parallel(keys, n);
+        assert(_same_shape(tree.root, parallel.root));
+        tree_delete(&parallel);
+
+        //Still an AVL tree for further insertions
+        assert(tree_insert_key_balanced(&tree, SIZE * 3));
+        assert(!tree_insert_key_balanced(&tree, n > 0? keys[0] : SIZE * 3));
+        _check_avl(tree.root);
+        tree_delete(&tree);
+    }
+
+    free(keys);
+}
+
+void test_search_indices() {
+    int sizes[] = {0, 1, 15, 16, 17, 256, 257, 5000};
+    for(int s = 0; s < 8; ++s) {
+        int n = sizes[s];
+        Tree tree = tree_create();
+        for(int i = 0; i < n; ++i) { //Odd keys, the even ones are missing
+            tree_insert_key(&tree, 2*((int)((i * 7919L) % n)) + 1);
+        }
+        tree_insert_key(&tree, n > 0? INT_MAX : 1); //Same as the padding
+
+        size_t count;
+        int* sorted = tree_sorted_keys(tree, &count);
+        assert(count == (size_t)n + 1);
+        for(size_t i = 1; i < count; ++i) {
+            assert(sorted[i - 1] < sorted[i]);
+        }
+        free(sorted);
+
+        EytzingerIndex eytzinger = eytzinger_create(tree);
+        BTreeIndex btree = btree_create(tree);
+        for(int key = -3; key <= 2*n + 3; ++key) {
+            bool expected = tree_find_key_iterative(tree, key) != NULL;
+            assert(eytzinger_find_key(eytzinger, key) == expected);
+            assert(btree_find_key(btree, key) == expected);
+        }
+        int extremes[] = {INT_MIN, INT_MAX - 1, INT_MAX};
+        for(int i = 0; i < 3; ++i) {
+            bool expected = tree_find_key_iterative(tree, extremes[i]) != NULL;
+            assert(eytzinger_find_key(eytzinger, extremes[i]) == expected);
+            assert(btree_find_key(btree, extremes[i]) == expected);
+        }
+        eytzinger_delete(&eytzinger);
+        btree_delete(&btree);
+        tree_delete(&tree);
+    }
+}
+
+//Checks the order of the keys and counts them
+int _check_concurrent(ConcurrentNode* node, long long low, long long high) {
+    if(!node) {
+        return 0;
+    }
+    assert(low < node->key && node->key < high);
+
+    return 1 + _check_concurrent(atomic_load(&node->smaller_keys), low,
+                                 node->key)
+             + _check_concurrent(atomic_load(&node->larger_keys), node->key,
+                                 high);
+}
+
+//All threads insert the same shared keys and keys of their own, and look up
+//what they inserted right away and what others inserted
+void test_concurrent_tree() {
+    const int THREADS = 4;
+    const int SHARED = 20000; //Different shared keys
+    const int OWN = 20000; //Keys of every thread
+    ConcurrentTree tree;
+    concurrent_tree_init(&tree);
+    atomic_int shared_inserted = 0;
+    atomic_int own_inserted = 0;
+    atomic_int threads = 0;
+
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(THREADS)
+#endif
+    {
+        int thread = thread_number();
+        atomic_fetch_add(&threads, 1);
+        ConcurrentWriter writer = concurrent_writer_create(&tree);
+        unsigned int random_state = 17 + thread;
+        for(int i = 0; i < 2*OWN; ++i) {
+            random_state = random_state * 1103515245u + 12345u;
+            int key;
+            if(i % 2) {
+                key = (int)((random_state >> 8) % SHARED) * 2; //Even
+            }
+            else {
+                key = ((i / 2 * THREADS + thread) * 7919 % 1000003) * 2 + 1;
+            }
+
+            ConcurrentNode* node = concurrent_tree_insert_key(&writer, key);
+            if(node) {
+                assert(node->key == key);
+                atomic_fetch_add(key % 2? &own_inserted : &shared_inserted, 1);
+            }
+            assert(concurrent_tree_find_key(&tree, key));
+            assert(!concurrent_tree_find_key(&tree, -key - 1));
+        }
+        concurrent_writer_delete(&writer);
+    }
+
+    //Every key was inserted exactly once
+    int count = _check_concurrent(atomic_load(&tree.root), NO_LOWER_BOUND,
+                                  NO_UPPER_BOUND);
+    assert(count == shared_inserted + own_inserted);
+    assert(own_inserted == threads * OWN);
+    for(int key = 0; key < 2*SHARED; key += 2) {
+        bool found = concurrent_tree_find_key(&tree, key) != NULL;
+        shared_inserted -= found;
+    }
+    assert(shared_inserted == 0);
+    concurrent_tree_delete(&tree);
+    assert(concurrent_tree_find_key(&tree, 1) == NULL);
+}
+
+void test_persistent_tree() {
+    PersistentStore store;
+    persistent_store_init(&store);
+    PersistentTree tree = persistent_tree_create(&store);
+    PersistentTree empty = persistent_tree_snapshot(tree);
+
+    //A snapshot after every 100 keys, each one must keep exactly its keys
+    const int VERSIONS = 20;
+    PersistentTree snapshots[VERSIONS];
+    for(int version = 0; version < VERSIONS; ++version) {
+        for(int i = 0; i < 100; ++i) {
+            int key = version * 100 + i;
+            key = key % 2? key : -key; //Zigzag, needs rotations
+            assert(persistent_tree_insert_key(&tree, key)->key == key);
+            assert(persistent_tree_insert_key(&tree, key) == NULL);
+        }
+        snapshots[version] = persistent_tree_snapshot(tree);
+    }
+    //Changing the tree after the last snapshot doesn't change the snapshot
+    assert(persistent_tree_insert_key(&tree, 1000000));
+
+    for(int version = 0; version < VERSIONS; ++version) {
+        Tree view = persistent_tree_view(snapshots[version]);
+        assert(tree_is_valid(view));
+        _check_avl(view.root);
+        for(int key = 0; key < VERSIONS * 100; ++key) {
+            int stored = key % 2? key : -key;
+            bool expected = key < (version + 1) * 100;
+            assert((tree_find_key_iterative(view, stored) != NULL)
+                   == expected);
+        }
+        assert(!tree_find_key_iterative(view, 1000000));
+    }
+    assert(tree_find_key_iterative(persistent_tree_view(tree), 1000000));
+    assert(persistent_tree_view(empty).root == NULL);
+
+    //Versions share most of their nodes: Every insertion copies one path
+    assert(store.live_nodes < (size_t)VERSIONS * 100 * 3);
+
+    //Deleting versions in any order frees exactly what nobody uses anymore
+    for(int version = 0; version < VERSIONS; version += 2) {
+        persistent_tree_delete(&snapshots[version]);
+    }
+    PersistentTree copy = persistent_tree_snapshot(snapshots[1]);
+    persistent_tree_delete(&tree);
+    for(int version = 1; version < VERSIONS; version += 2) {
+        persistent_tree_delete(&snapshots[version]);
+    }
+    assert(tree_depth(persistent_tree_view(copy)) > 0);
+    assert(tree_is_valid(persistent_tree_view(copy)));
+    persistent_tree_delete(&copy);
+    persistent_tree_delete(&empty);
+    assert(store.live_nodes == 0);
+
+    //Readers check and drop their snapshots while thread 0 keeps inserting
+    tree = persistent_tree_create(&store);
+    for(int version = 0; version < VERSIONS; ++version) {
+        for(int i = 0; i < 100; ++i) {
+            persistent_tree_insert_key(&tree, version * 100 + i);
+        }
+        snapshots[version] = persistent_tree_snapshot(tree);
+    }
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(4)
+#endif
+    {
+        int thread = thread_number();
+        int threads = 1;
+#ifdef _OPENMP
+        threads = omp_get_num_threads();
+#endif
+        if(thread == 0) {
+            for(int key = VERSIONS * 100; key < VERSIONS * 1000; ++key) {
+                persistent_tree_insert_key(&tree, key);
+            }
+        }
+        for(int version = thread; version < VERSIONS; version += threads) {
+            Tree view = persistent_tree_view(snapshots[version]);
+            assert(tree_is_valid(view));
+            assert(tree_find_key_iterative(view, version * 100 + 99));
+            assert(!tree_find_key_iterative(view, version * 100 + 100));
+            persistent_tree_delete(&snapshots[version]);
+        }
+    }
+    Tree view = persistent_tree_view(tree);
+    assert(tree_is_valid(view));
+    _check_avl(view.root);
+    size_t count;
+    free(tree_sorted_keys(view, &count));
+    assert(count == (size_t)VERSIONS * 1000);
+    assert(store.live_nodes == count); //Only the tree's own nodes are left
+    persistent_tree_delete(&tree);
+    assert(store.live_nodes == 0);
+
+    //A list of 1000 nodes: The path is longer than AVL_MAX_DEPTH
+    tree = persistent_tree_create(&store);
+    for(int i = 0; i < 1000; ++i) {
+        Node node = {
+            .key = i,
+            .height = i + 1,
+            .smaller_keys = tree.root,
+            .larger_keys = NULL
+        };
+        Node* root = persistent_node_copy(&store, &node);
+        persistent_node_release(&store, tree.root);
+        tree.root = root;
+    }
+    PersistentTree list = persistent_tree_snapshot(tree);
+    assert(persistent_tree_insert_key(&tree, -1)->key == -1);
+    assert(persistent_tree_insert_key(&tree, 500) == NULL);
+    assert(tree_is_valid(persistent_tree_view(tree)));
+    assert(tree_find_key_iterative(persistent_tree_view(tree), -1));
+    assert(!tree_find_key_iterative(persistent_tree_view(list), -1));
+    persistent_tree_delete(&list);
+    persistent_tree_delete(&tree);
+    assert(store.live_nodes == 0);
+    persistent_store_delete(&store);
+}
+
+void test_pool() {
+    Pool pool = pool_create(sizeof(Node));
+    Node* first = (Node*)pool_allocate(&pool);
+    Node* second = (Node*)pool_allocate(&pool);
+    assert(second == first + 1); //Nodes are contiguous within a chunk
+
+    pool_free(&pool, first);
+    assert(pool_allocate(&pool) == first); //Freed elements are reused
+
+    //Many chunks, all elements distinct and writable
+    for(int i = 0; i < 100000; ++i) {
+        Node* node = (Node*)pool_allocate(&pool);
+        node->key = i;
+    }
+    pool_destroy(&pool);
+    assert(pool.chunks == NULL);
+
+    //Deleting a big tree only frees its chunks
+    Tree tree = tree_create();
+    for(int i = 0; i < 100000; ++i) {
+        tree_insert_key(&tree, (int)((i * 7919L) % 100003));
+    }
+    assert(tree_is_valid(tree));
+    tree_delete(&tree);
+    assert(tree.root == NULL && tree.nodes.chunks == NULL);
+}
+
+//=============================================================================
+//Benchmark
+//=============================================================================
+
+//Random lookups in the tree, one by one and as a batch, and in both indices.
+//The tree is built from sorted keys, so its nodes lie in one block; a tree
+//built by random insertions would be even slower. Half of the looked up keys
+//are in the tree
+void benchmark_search_indices(int max_keys) {
+    const int LOOKUPS = 10000000;
+    printf("keys,tree_ns,eytzinger_ns,btree_ns,tree_batch_ns\n");
+
+    for(int n = 1000000; n <= max_keys; n *= 10) {
+        int* keys = (int*)malloc(n * sizeof(int));
+        int* lookups = (int*)malloc(LOOKUPS * sizeof(int));
+        for(int i = 0; i < n; ++i) {
+            keys[i] = 2*i;
+        }
+        unsigned int random_state = 42;
+        for(int i = 0; i < LOOKUPS; ++i) {
+            random_state = random_state * 1103515245u + 12345u;
+            lookups[i] = (int)((random_state >> 1) % (2u * n));
+        }
+
+        Tree tree = tree_build_from_sorted(keys, n);
+        EytzingerIndex eytzinger = eytzinger_create(tree);
+        BTreeIndex btree = btree_create(tree);
+
+        double ns[4];
+        int found[4] = {0, 0, 0, 0};
+        for(int variant = 0; variant < 3; ++variant) {
+            clock_t start = clock();
+            for(int i = 0; i < LOOKUPS; ++i) {
+                if(variant == 0) {
+                    found[0] += tree_find_key_iterative(tree, lookups[i])
+                                != NULL;
+                }
+                else if(variant == 1) {
+                    found[1] += eytzinger_find_key(eytzinger, lookups[i]);
+                }
+                else {
+                    found[2] += btree_find_key(btree, lookups[i]);
+                }
+            }
+            ns[variant] = (double)(clock() - start) / CLOCKS_PER_SEC
+                          * 1e9 / LOOKUPS;
+        }
+        Node** results = (Node**)malloc(LOOKUPS * sizeof(Node*));
+        clock_t start = clock();
+        tree_find_keys_batch(tree, lookups, LOOKUPS, results);
+        ns[3] = (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / LOOKUPS;
+        for(int i = 0; i < LOOKUPS; ++i) {
+            found[3] += results[i] != NULL;
+        }
+        free(results);
+
+        assert(found[0] == found[1] && found[0] == found[2]);
+        assert(found[0] == found[3]);
+        printf("%d,%.1f,%.1f,%.1f,%.1f\n", n, ns[0], ns[1], ns[2], ns[3]);
+        fflush(stdout);
+
+        eytzinger_delete(&eytzinger);
+        btree_delete(&btree);
+        tree_delete(&tree);
+        free(lookups);
+        free(keys);
+        if(n > max_keys / 10) {
+            break; //The next n could overflow
+        }
+    }
+}
+
+//xorshift32, the low bits of a linear congruential generator repeat too soon
+//for random keys modulo a power of two
+unsigned int next_random(unsigned int* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+
+    return *state;
+}
+
+//Takes a snapshot before every insertion into a persistent tree and reports
+//the memory each version costs, compared to a snapshot with tree_deep_copy
+void benchmark_persistent_tree(int keys) {
+    const int VERSIONS = 100000;
+    printf("keys,versions,ns_per_version,bytes_per_version,"
+           "deep_copy_ns,deep_copy_bytes\n");
+
+    PersistentStore store;
+    persistent_store_init(&store);
+    PersistentTree tree = persistent_tree_create(&store);
+    unsigned int random_state = 1;
+    size_t size = 0;
+    for(int i = 0; i < keys; ++i) {
+        size += persistent_tree_insert_key(&tree,
+                                           (int)next_random(&random_state))
+                != NULL;
+    }
+    size_t live_nodes = store.live_nodes;
+
+    PersistentTree* snapshots = (PersistentTree*)malloc(
+        VERSIONS * sizeof(PersistentTree));
+    clock_t start = clock();
+    for(int i = 0; i < VERSIONS; ++i) {
+        snapshots[i] = persistent_tree_snapshot(tree);
+        size += persistent_tree_insert_key(&tree,
+                                           (int)next_random(&random_state))
+                != NULL;
+    }
+    double ns = (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / VERSIONS;
+    double bytes = (double)(store.live_nodes - live_nodes)
+                   * sizeof(PersistentNode) / VERSIONS;
+
+    start = clock();
+    Tree copy = tree_deep_copy(persistent_tree_view(tree));
+    double deep_copy_ns = (double)(clock() - start) / CLOCKS_PER_SEC * 1e9;
+    size_t deep_copy_bytes = sizeof(Node) * size;
+    tree_delete(&copy);
+
+    printf("%d,%d,%.0f,%.0f,%.0f,%zu\n", keys, VERSIONS, ns, bytes,
+           deep_copy_ns, deep_copy_bytes);
+
+    for(int i = 0; i < VERSIONS; ++i) {
+        persistent_tree_delete(&snapshots[i]);
+    }
+    persistent_tree_delete(&tree);
+    assert(store.live_nodes == 0);
+    persistent_store_delete(&store);
+    free(snapshots);
+}
+
+#ifdef _OPENMP
+//Every thread does the same number of random operations on a concurrent tree
+//that starts with a million keys. write_percent of them are insertions, the
+//others lookups. The keys come from a range 4 times the size of the tree at
+//the start, so a quarter of the first lookups are hits
+void benchmark_concurrent_tree(int max_threads) {
+    const int PREFILL = 1000000;
+    const int OPERATIONS = 1000000;
+    const unsigned int KEY_RANGE = 4 * PREFILL;
+    int write_percents[] = {0, 1, 10, 50};
+    printf("threads,write_percent,seconds,million_operations_per_second\n");
+
+    for(int w = 0; w < 4; ++w) {
+        for(int threads = 1;; threads *= 2) {
+            if(threads > max_threads) {
+                threads = max_threads;
+            }
+
+            ConcurrentTree tree;
+            concurrent_tree_init(&tree);
+            ConcurrentWriter writer = concurrent_writer_create(&tree);
+            unsigned int random_state = 1;
+            for(int i = 0; i < PREFILL; ++i) {
+                int key = (int)(next_random(&random_state) % KEY_RANGE);
+                concurrent_tree_insert_key(&writer, key);
+            }
+            concurrent_writer_delete(&writer);
+
+            atomic_int found = 0;
+            double start = omp_get_wtime();
+            #pragma omp parallel num_threads(threads)
+            {
+                ConcurrentWriter writer = concurrent_writer_create(&tree);
+                unsigned int random_state = 2 + thread_number();
+                int thread_found = 0;
+                for(int i = 0; i < OPERATIONS; ++i) {
+                    int key = (int)(next_random(&random_state) % KEY_RANGE);
+                    int percent = (int)(next_random(&random_state) % 100);
+                    if(percent < write_percents[w]) {
+                        concurrent_tree_insert_key(&writer, key);
+                    }
+                    else {
+                        thread_found += concurrent_tree_find_key(&tree, key)
+                                        != NULL;
+                    }
+                }
+                concurrent_writer_delete(&writer);
+                atomic_fetch_add(&found, thread_found);
+            }
+            double seconds = omp_get_wtime() - start;
+            printf("%d,%d,%.3f,%.2f\n", threads, write_percents[w], seconds,
+                   (double)threads * OPERATIONS / seconds / 1e6);
+            fflush(stdout);
+            concurrent_tree_delete(&tree);
+
+            if(threads == max_threads) {
+                break;
+            }
+        }
+    }
+}
+#endif
+
+//Runs the tests. "./a.out benchmark [max_keys]" runs the benchmarks instead,
+//with 10^6, 10^7, ... keys up to max_keys (default 10^7, 10^8 needs ~4 GB).
+//"./a.out concurrent [max_threads]" runs the benchmark of the concurrent tree
+//with 1, 2, 4, ... threads, it needs -fopenmp. "./a.out persistent [keys]"
+//runs the benchmark of the persistent tree (default 10^6 keys)
+int main(int argc, char** argv) {
+    if(argc > 1 && strcmp(argv[1], "benchmark") == 0) {
+        benchmark_search_indices(argc > 2? atoi(argv[2]) : 10000000);
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "concurrent") == 0) {
+#ifdef _OPENMP
+        int max_threads = argc > 2? atoi(argv[2]) : omp_get_max_threads();
+        if(max_threads < 1) {
+            fprintf(stderr, "max_threads has to be a number >= 1\n");
+            return 1;
+        }
+        benchmark_concurrent_tree(max_threads);
+#else
+        printf("The concurrent benchmark needs -fopenmp\n");
+#endif
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "persistent") == 0) {
+        benchmark_persistent_tree(argc > 2? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+
+    test_pool();
+    test_stack_and_scratch();
+    test_balanced_insertion();
+    test_build_from_sorted();
+    test_search_indices();
+    test_concurrent_tree();
+    test_persistent_tree();
     test_tree_is_valid();
     test_deep_copy();
     test_insertion_and_deletion();
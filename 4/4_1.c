@@ -1,9 +1,63 @@
-// Compiled and executed with mpicc -o 4_1 4_1.c galton.c -Wall -O3 && mpirun
-// -np 8 4_1
+// Compiled and executed with mpicc -o 4_1 4_1.c galton.c galton_simd.c
+// galton_wavefront.c philox.c binomial.c -Wall -O3 -fopenmp -lm && mpirun -np
+// 8 4_1 [--dynamic | --progress K --tolerance T | --chunk N --checkpoint FILE
+// | --restart FILE]
+// or for a parameter sweep: mpirun -np 8 4_1 --sweep jobs.txt [--output
+// results.csv] [--group-size G]
 #include "galton.h"
+#include <limits.h>
 #include <mpi.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+// Message tags of the dynamic scheduler
+enum { TAG_REQUEST = 1, TAG_CHUNK, TAG_STATISTICS };
+
+// Smallest chunk the dynamic scheduler hands out. Smaller chunks balance the
+// load better, but every chunk costs a round trip to the master
+const int64_t MINIMUM_CHUNK_SIZE = 10000;
+
+// The master simulates between dispatches in slices of about this many
+// seconds, so requests of the workers don't wait long
+const double MASTER_SLICE_SECONDS = 0.01;
+
+// Balls per process between two convergence checks if --tolerance is given
+// without --progress
+const int64_t DEFAULT_PROGRESS_INTERVAL = 1 << 20;
+
+// Balls per process and chunk of the static mode, without and with checkpoints
+const int64_t DEFAULT_CHUNK_SIZE = INT64_C(1) << 32;
+const int64_t DEFAULT_CHECKPOINT_INTERVAL = INT64_C(1) << 28;
+
+/**
+ * @brief Command line options of 4_1, the same on every process
+ */
+typedef struct Options {
+    bool dynamic; // --dynamic: Workers request chunks of balls from the master
+    // --progress K: Reduce the partial histograms every K balls per process,
+    // 0 to reduce only at the end
+    int64_t progress_interval;
+    // --tolerance T: Stop once the KL divergence of the histogram from the
+    // exact distribution is at most T, checked every progress_interval balls
+    double tolerance;
+    // --sweep FILE: Run all jobs of a job file instead of reading one
+    // configuration, see read_jobs
+    const char *job_file;
+    // --output FILE: Where the sweep writes its CSV results
+    const char *results_file;
+    // --group-size G: Number of processes that share a job of the sweep
+    int group_size;
+    // --chunk N: Every process simulates at most N balls at a time and the
+    // master reports the throughput of each of its chunks
+    int64_t chunk_size;
+    // --checkpoint FILE: Write a checkpoint after every chunk
+    const char *checkpoint_file;
+    // --restart FILE: Continue from a checkpoint instead of reading the state.
+    // Further checkpoints go to the same file unless --checkpoint is given
+    const char *restart_file;
+} Options;
 
 /**
  * @brief Gets the rank (i. e. "Process number") of the current process
@@ -25,55 +79,524 @@ int get_number_of_processes() {
     return np;
 }
 
+/**
+ * @brief What a process still has to do, and the histogram of what it has done
+ */
+typedef struct ProcessProgress {
+    // first_ball is the next ball of the process, number_of_balls the number
+    // of balls it has left
+    SimulationState remaining;
+    int64_t *histogram;
+} ProcessProgress;
+
+ProcessProgress start_process(SimulationState state) {
+    // The balls of process r start after those of processes 0, ..., r - 1.
+    // Together with the seed, this selects the random bits of every ball, so
+    // the result doesn't depend on the number of processes or threads
+    ProcessProgress progress = {
+        .remaining =
+            split_balls(state, get_rank(), get_number_of_processes()),
+        .histogram = create_histogram(state)};
+    return progress;
+}
+
+#define CHECKPOINT_MAGIC "GALTONCP"
+
+/**
+ * @brief A checkpoint file starts with this header, followed by one record per
+ * process. A record is a CheckpointRecord and the histogram of the process
+ */
+typedef struct CheckpointHeader {
+    char magic[8];
+    int32_t number_of_processes;
+    int32_t number_of_compartments;
+    int64_t number_of_balls;
+    int32_t engine;
+    int32_t number_of_threads;
+    uint64_t seed;
+} CheckpointHeader;
+
+typedef struct CheckpointRecord {
+    // The random numbers are a function of the ball index, so the next ball
+    // is the position of the generator: Its counter is next_ball times the
+    // words per ball
+    int64_t next_ball;
+    int64_t remaining_balls;
+} CheckpointRecord;
+
+MPI_Offset checkpoint_record_offset(SimulationState state, int rank) {
+    size_t record_size = sizeof(CheckpointRecord) +
+                         state.number_of_compartments * sizeof(int64_t);
+    return (MPI_Offset)(sizeof(CheckpointHeader) + rank * record_size);
+}
+
+/**
+ * @brief Writes the progress of all processes to one file with MPI-IO. Every
+ * process writes its own record with a collective write. The file is written
+ * under a temporary name and renamed when complete, so an interruption while
+ * writing leaves the previous checkpoint intact. Must be called by all
+ * processes
+ */
+void write_checkpoint(const char *path, SimulationState state,
+                      ProcessProgress progress) {
+    int rank = get_rank();
+    char *temporary_path = (char *)malloc(strlen(path) + 5);
+    sprintf(temporary_path, "%s.tmp", path);
+
+    MPI_File file;
+    if (MPI_File_open(MPI_COMM_WORLD, temporary_path,
+                      MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL,
+                      &file) != MPI_SUCCESS) {
+        if (rank == 0) {
+            printf("Can't write the checkpoint %s\n", temporary_path);
+        }
+        free(temporary_path);
+        return;
+    }
+    // A leftover .tmp from an interrupted run may be longer than this one
+    MPI_File_set_size(file, 0);
+
+    if (rank == 0) {
+        CheckpointHeader header = {
+            .number_of_processes = get_number_of_processes(),
+            .number_of_compartments = state.number_of_compartments,
+            .number_of_balls = state.number_of_balls,
+            .engine = state.engine,
+            .number_of_threads = state.number_of_threads,
+            .seed = state.seed};
+        memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+        MPI_File_write_at(file, 0, &header, sizeof(header), MPI_BYTE,
+                          MPI_STATUS_IGNORE);
+    }
+
+    size_t histogram_size = state.number_of_compartments * sizeof(int64_t);
+    char *record = (char *)malloc(sizeof(CheckpointRecord) + histogram_size);
+    CheckpointRecord position = {
+        .next_ball = progress.remaining.first_ball,
+        .remaining_balls = progress.remaining.number_of_balls};
+    memcpy(record, &position, sizeof(position));
+    memcpy(record + sizeof(position), progress.histogram, histogram_size);
+    MPI_File_write_at_all(file, checkpoint_record_offset(state, rank), record,
+                          (int)(sizeof(position) + histogram_size), MPI_BYTE,
+                          MPI_STATUS_IGNORE);
+    MPI_File_sync(file);
+    MPI_File_close(&file);
+
+    if (rank == 0) {
+        rename(temporary_path, path);
+    }
+    free(record);
+    free(temporary_path);
+}
+
+/**
+ * @brief Restores the state of the simulation and the progress of every
+ * process from a checkpoint. The number of processes has to be the one that
+ * wrote it. Must be called by all processes
+ * @return false if the file can't be used
+ */
+bool read_checkpoint(const char *path, SimulationState *state,
+                     ProcessProgress *progress) {
+    int rank = get_rank();
+    MPI_File file;
+    if (MPI_File_open(MPI_COMM_WORLD, path, MPI_MODE_RDONLY, MPI_INFO_NULL,
+                      &file) != MPI_SUCCESS) {
+        if (rank == 0) {
+            printf("Can't open the checkpoint %s\n", path);
+        }
+        return false;
+    }
+
+    // Every process reads the header, so they all agree whether it's valid
+    CheckpointHeader header;
+    MPI_File_read_at_all(file, 0, &header, sizeof(header), MPI_BYTE,
+                         MPI_STATUS_IGNORE);
+    bool valid =
+        memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0;
+    if (!valid || header.number_of_processes != get_number_of_processes()) {
+        if (rank == 0) {
+            printf(valid ? "The checkpoint %s was written by %d processes\n"
+                         : "%s is not a checkpoint\n",
+                   path, header.number_of_processes);
+        }
+        MPI_File_close(&file);
+        return false;
+    }
+
+    SimulationState restored = {
+        .number_of_balls = header.number_of_balls,
+        .number_of_compartments = header.number_of_compartments,
+        .number_of_rows = header.number_of_compartments - 1,
+        .engine = header.engine,
+        .seed = header.seed,
+        .first_ball = 0,
+        .number_of_threads = header.number_of_threads};
+    *state = restored;
+
+    CheckpointRecord position;
+    progress->histogram = create_histogram(restored);
+    size_t histogram_size = restored.number_of_compartments * sizeof(int64_t);
+    char *record = (char *)malloc(sizeof(position) + histogram_size);
+    MPI_File_read_at_all(file, checkpoint_record_offset(restored, rank),
+                         record, (int)(sizeof(position) + histogram_size),
+                         MPI_BYTE, MPI_STATUS_IGNORE);
+    MPI_File_close(&file);
+    memcpy(&position, record, sizeof(position));
+    memcpy(progress->histogram, record + sizeof(position), histogram_size);
+    free(record);
+
+    progress->remaining = restored;
+    progress->remaining.first_ball = position.next_ball;
+    progress->remaining.number_of_balls = position.remaining_balls;
+    if (rank == 0) {
+        printf("Restarting from %s\n", path);
+    }
+    return true;
+}
+
 /**
  * @brief Runs the simulation on a single process. The balls are evenly
- * distributed among the processes. The results are sent to the master process
- * (rank 0) with MPI_Send
+ * distributed among all processes, including the master process (see
+ * start_process). Every process uses state.number_of_threads threads, so with
+ * one process per node all cores are busy
  * @param state The state of the simulation (total number of balls, compartments
  * and rows of the galton board)
+ * @param progress Where the process starts, see start_process and
+ * read_checkpoint
+ * @param chunk_size The balls are simulated in chunks of at most this many
+ * balls. The memory doesn't depend on it, but with more than one chunk the
+ * master prints the throughput of each of its chunks
+ * @param checkpoint_file If not NULL, all processes write a checkpoint there
+ * after every chunk
+ * @return The histogram of this process
+ */
+int64_t *run_simulation_process(SimulationState state,
+                                ProcessProgress progress, int64_t chunk_size,
+                                const char *checkpoint_file) {
+    // Checkpoints are collective, so every process takes part in every round,
+    // even when it is out of balls
+    int64_t most_remaining;
+    MPI_Allreduce(&progress.remaining.number_of_balls, &most_remaining, 1,
+                  MPI_INT64_T, MPI_MAX, MPI_COMM_WORLD);
+    int64_t rounds = number_of_chunks(most_remaining, chunk_size);
+    bool report = get_rank() == 0 && rounds > 1;
+
+    for (int64_t round = 0; round < rounds; ++round) {
+        SimulationState chunk = progress.remaining;
+        if (chunk.number_of_balls > chunk_size) {
+            chunk.number_of_balls = chunk_size;
+        }
+
+        double start = MPI_Wtime();
+        if (chunk.number_of_balls > 0) {
+            simulate(chunk, progress.histogram);
+        }
+        double seconds = MPI_Wtime() - start;
+        progress.remaining.first_ball += chunk.number_of_balls;
+        progress.remaining.number_of_balls -= chunk.number_of_balls;
+
+        if (report) {
+            printf("Chunk of %lld balls: %.3f s, %.4g balls/s\n",
+                   (long long)chunk.number_of_balls, seconds,
+                   chunk.number_of_balls / seconds);
+        }
+        if (checkpoint_file != NULL) {
+            write_checkpoint(checkpoint_file, state, progress);
+        }
+    }
+
+    return progress.histogram;
+}
+
+/**
+ * @brief Adds the histograms of all processes on the master process (rank = 0)
+ * and displays the sum there. Must be called by all processes
+ * @param state State of the simulation
+ * @param histogram The histogram simulated by the calling process
  */
-void run_simulation_process(SimulationState state) {
+void gather_simulation_results(SimulationState state, int64_t *histogram) {
+    int64_t *histogram_sum = get_rank() == 0 ? create_histogram(state) : NULL;
+    // The MPI library sums along a tree, O(log p) steps instead of p receives
+    // on the master. 64 bit counts can't overflow, even for thousands of ranks
+    MPI_Reduce(histogram, histogram_sum, state.number_of_compartments,
+               MPI_INT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    if (get_rank() == 0) {
+        display_histogram(histogram_sum, state);
+        free(histogram_sum);
+    }
+}
+
+void print_progress(int64_t *histogram_sum, SimulationState state,
+                    int64_t balls_so_far) {
+    SimulationState so_far = state;
+    so_far.number_of_balls = balls_so_far;
+    int degrees_of_freedom;
+    double chi_square =
+        chi_square_to_exact(histogram_sum, so_far, &degrees_of_freedom);
+    printf("%11lld of %lld balls: chi-square %.1f with %d degrees of freedom, "
+           "KL divergence %.3g\n",
+           (long long)balls_so_far, (long long)state.number_of_balls,
+           chi_square, degrees_of_freedom,
+           kl_divergence_to_exact(histogram_sum, so_far));
+}
+
+/**
+ * @brief Like run_simulation_process followed by gather_simulation_results,
+ * but every process simulates its balls in rounds of progress_interval balls.
+ * After every round, the sum of the histograms so far is reduced with
+ * MPI_Ireduce while the next round is simulated. The master prints how close
+ * each partial sum is to the exact distribution.
+ * With a tolerance > 0, the sum is reduced to all processes (MPI_Iallreduce)
+ * instead. Every process computes the same KL divergence from it, so they all
+ * stop after the same round once it is at most tolerance, without any further
+ * messages
+ */
+void run_progressive_simulation(SimulationState state,
+                                int64_t progress_interval, double tolerance) {
     int rank = get_rank();
-    int np = get_number_of_processes() -
-             1; // Discount the master process, it's not simulating
+    int np = get_number_of_processes();
+    int size = state.number_of_compartments;
+    SimulationState process_state = split_balls(state, rank, np);
+    // Process 0 gets the most balls, all processes take part in every round
+    int64_t rounds =
+        (split_balls(state, 0, np).number_of_balls + progress_interval - 1) /
+        progress_interval;
 
-    int remainder = state.number_of_balls % np;
-    state.number_of_balls = state.number_of_balls / np;
+    int64_t *histogram = create_histogram(state);
+    // The buffers of a pending reduction must not change until it is done
+    int64_t *send_buffer = create_histogram(state);
+    int64_t *histogram_sum = create_histogram(state);
+    MPI_Request request = MPI_REQUEST_NULL;
+    int64_t simulated = 0;
+    int64_t balls_in_reduction = 0;
+    bool converged = false;
 
-    if (rank <= remainder) {
-        // If we can't evenly distribute the balls among the processes, the
-        // first n = remainder processes will take 1 extra ball.
-        ++state.number_of_balls;
+    for (int64_t round = 0; round < rounds; ++round) {
+        SimulationState chunk = process_state;
+        chunk.first_ball += simulated;
+        chunk.number_of_balls = process_state.number_of_balls - simulated;
+        if (chunk.number_of_balls > progress_interval) {
+            chunk.number_of_balls = progress_interval;
+        }
+        if (chunk.number_of_balls > 0) {
+            simulate(chunk, histogram);
+            simulated += chunk.number_of_balls;
+        }
+
+        // The previous round had the whole simulation of this one to finish
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+        if (round > 0) {
+            if (rank == 0) {
+                print_progress(histogram_sum, state, balls_in_reduction);
+            }
+            SimulationState so_far = state;
+            so_far.number_of_balls = balls_in_reduction;
+            if (tolerance > 0 &&
+                kl_divergence_to_exact(histogram_sum, so_far) <= tolerance) {
+                // The balls of this round come too late, the result is the
+                // sum of the previous one
+                converged = true;
+                break;
+            }
+        }
+
+        memcpy(send_buffer, histogram, size * sizeof(int64_t));
+        if (tolerance > 0) {
+            MPI_Iallreduce(send_buffer, histogram_sum, size, MPI_INT64_T,
+                           MPI_SUM, MPI_COMM_WORLD, &request);
+        } else {
+            MPI_Ireduce(send_buffer, histogram_sum, size, MPI_INT64_T,
+                        MPI_SUM, 0, MPI_COMM_WORLD, &request);
+        }
+        balls_in_reduction = 0;
+        for (int i = 0; i < np; ++i) {
+            int64_t balls = split_balls(state, i, np).number_of_balls;
+            int64_t done = (round + 1) * progress_interval;
+            balls_in_reduction += done < balls ? done : balls;
+        }
+    }
+    MPI_Wait(&request, MPI_STATUS_IGNORE);
+
+    if (rank == 0) {
+        if (converged) {
+            printf("Converged after %lld of %lld balls\n",
+                   (long long)balls_in_reduction,
+                   (long long)state.number_of_balls);
+        } else {
+            print_progress(histogram_sum, state, balls_in_reduction);
+        }
+        display_histogram(histogram_sum, state);
+    }
+
+    free(histogram_sum);
+    free(send_buffer);
+    free(histogram);
+}
+
+/**
+ * @brief Hands out consecutive chunks of the balls with guided self-scheduling:
+ * Every chunk is a fixed fraction of the balls that are left, so the chunks are
+ * large at the beginning (few messages) and small at the end (slow processes
+ * can't hold up the others for long)
+ */
+typedef struct Scheduler {
+    SimulationState state; // All balls of the simulation
+    int64_t dispatched;    // Number of balls handed out so far
+} Scheduler;
+
+/**
+ * @brief Takes the next chunk of at most max_size balls
+ * @return The state for the chunk, number_of_balls is 0 if all balls are gone
+ */
+SimulationState scheduler_next_chunk(Scheduler *scheduler, int64_t max_size) {
+    int64_t remaining =
+        scheduler->state.number_of_balls - scheduler->dispatched;
+    int64_t size = remaining / (2 * get_number_of_processes());
+    if (size < MINIMUM_CHUNK_SIZE) {
+        size = MINIMUM_CHUNK_SIZE;
+    }
+    if (size > max_size) {
+        size = max_size;
     }
+    if (size > remaining) {
+        size = remaining;
+    }
+
+    SimulationState chunk = scheduler->state;
+    chunk.first_ball += scheduler->dispatched;
+    chunk.number_of_balls = size;
+    scheduler->dispatched += size;
+
+    return chunk;
+}
+
+/**
+ * @brief How many balls and chunks a process simulated and how long it took
+ */
+typedef struct Statistics {
+    double balls;
+    double chunks;
+    double seconds;
+} Statistics;
+
+void simulate_chunk(SimulationState chunk, int64_t *histogram,
+                    Statistics *statistics) {
+    double start = MPI_Wtime();
+    simulate(chunk, histogram);
+    statistics->seconds += MPI_Wtime() - start;
+    statistics->balls += chunk.number_of_balls;
+    ++statistics->chunks;
+}
 
-    int *histogram = run_simulation(state);
+/**
+ * @brief Worker side of the dynamic scheduler: Requests a chunk, simulates it
+ * and sends its histogram along with the next request, until the master
+ * answers with an empty chunk. The statistics are sent at the end
+ */
+void run_dynamic_worker(SimulationState state) {
     int size = state.number_of_compartments;
-    MPI_Send(histogram, size, MPI_INT, 0, 0, MPI_COMM_WORLD);
+    int64_t *histogram = create_histogram(state);
+    Statistics statistics = {0};
+    // first_ball and number_of_balls of the chunk
+    int64_t chunk_range[2];
+
+    for (;;) {
+        MPI_Send(histogram, size, MPI_INT64_T, 0, TAG_REQUEST, MPI_COMM_WORLD);
+        memset(histogram, 0, size * sizeof(int64_t));
+
+        MPI_Recv(chunk_range, 2, MPI_INT64_T, 0, TAG_CHUNK, MPI_COMM_WORLD,
+                 MPI_STATUS_IGNORE);
+        if (chunk_range[1] == 0) {
+            break;
+        }
+
+        SimulationState chunk = state;
+        chunk.first_ball = chunk_range[0];
+        chunk.number_of_balls = chunk_range[1];
+        simulate_chunk(chunk, histogram, &statistics);
+    }
+
+    MPI_Send(&statistics, 3, MPI_DOUBLE, 0, TAG_STATISTICS, MPI_COMM_WORLD);
     free(histogram);
 }
 
+void print_statistics(Statistics *statistics, int np) {
+    printf("Process   Chunks        Balls   Seconds      Balls/s\n");
+    for (int i = 0; i < np; ++i) {
+        Statistics s = statistics[i];
+        double balls_per_second = s.seconds > 0 ? s.balls / s.seconds : 0;
+        printf("%7d %8.0f %12.0f %9.3f %12.4g\n", i, s.chunks, s.balls,
+               s.seconds, balls_per_second);
+    }
+    printf("\n");
+}
+
 /**
- * @brief Gathers the histograms sent by the other processes (ranks unequal 0)
- * using MPI_Recv, adds the results up and displays them
- * @param state State of the simulation
+ * @brief Master side of the dynamic scheduler: Answers requests with the next
+ * chunk and adds the histograms that come with them. While no request is
+ * pending, the master simulates small chunks itself. Their size follows its
+ * measured throughput, so it checks for requests about every
+ * MASTER_SLICE_SECONDS
  */
-void gather_simulation_results(SimulationState state) {
+void run_dynamic_master(SimulationState state) {
     int np = get_number_of_processes();
     int size = state.number_of_compartments;
-    int *histogram_sum = (int *)calloc(size, sizeof(int));
-    int *histogram = (int *)malloc(size * sizeof(int));
-    for (int i = 1; i < np; ++i) {
-        MPI_Recv(histogram, size, MPI_INT, i, 0, MPI_COMM_WORLD,
-                 MPI_STATUS_IGNORE);
-        printf("Result of process %i: ", i);
-        for (int j = 0; j < size; ++j) {
-            printf("%i ", histogram[j]);
-            histogram_sum[j] += histogram[j];
+    int64_t *histogram_sum = create_histogram(state);
+    int64_t *histogram = create_histogram(state);
+    Statistics *statistics = (Statistics *)calloc(np, sizeof(Statistics));
+    Scheduler scheduler = {.state = state, .dispatched = 0};
+
+    int active_workers = np - 1;
+    int64_t master_chunk_size = MINIMUM_CHUNK_SIZE;
+    while (active_workers > 0 ||
+           scheduler.dispatched < state.number_of_balls) {
+        int request_pending;
+        MPI_Status status;
+        MPI_Iprobe(MPI_ANY_SOURCE, TAG_REQUEST, MPI_COMM_WORLD,
+                   &request_pending, &status);
+
+        if (!request_pending && scheduler.dispatched < state.number_of_balls) {
+            simulate_chunk(scheduler_next_chunk(&scheduler, master_chunk_size),
+                           histogram_sum, &statistics[0]);
+            // Below the timer's resolution, the throughput isn't known yet.
+            // The size is capped in double, the cast of a bigger value to
+            // int64_t would be undefined
+            if (statistics[0].seconds > 0) {
+                double balls = statistics[0].balls / statistics[0].seconds *
+                               MASTER_SLICE_SECONDS;
+                if (balls > (double)state.number_of_balls) {
+                    balls = (double)state.number_of_balls;
+                }
+                master_chunk_size = (int64_t)balls + 1;
+            }
+            continue;
+        }
+
+        MPI_Recv(histogram, size, MPI_INT64_T, MPI_ANY_SOURCE, TAG_REQUEST,
+                 MPI_COMM_WORLD, &status);
+        for (int i = 0; i < size; ++i) {
+            histogram_sum[i] += histogram[i];
+        }
+
+        SimulationState chunk =
+            scheduler_next_chunk(&scheduler, state.number_of_balls);
+        int64_t chunk_range[2] = {chunk.first_ball, chunk.number_of_balls};
+        MPI_Send(chunk_range, 2, MPI_INT64_T, status.MPI_SOURCE, TAG_CHUNK,
+                 MPI_COMM_WORLD);
+        if (chunk.number_of_balls == 0) {
+            --active_workers;
         }
-        printf("\n");
     }
 
+    for (int i = 1; i < np; ++i) {
+        MPI_Recv(&statistics[i], 3, MPI_DOUBLE, i, TAG_STATISTICS,
+                 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+    print_statistics(statistics, np);
     display_histogram(histogram_sum, state);
+
+    free(statistics);
     free(histogram);
     free(histogram_sum);
 }
@@ -82,18 +605,20 @@ void gather_simulation_results(SimulationState state) {
  * @brief To broadcast the SimulationState struct across the processes, its
  * layout has to be defined here so that MPI can understand the sent data
  * @param MPI_state The MPI_Datatype that needs its layout to be defined
- * @note In this particular example, the SimulationState struct just contains 3
- * byte sized fields (3 ints), so MPI_BYTE could also be used as the datatype
- * for the broadcast without problems (with sizeof(SimulationState) for count).
- * This would not work for non-byte-sized fields like char*, so I wanted to
- * practice the general approach.
+ * @note In this particular example, the SimulationState struct just contains
+ * integers, so MPI_BYTE could also be used as the datatype for the
+ * broadcast without problems (with sizeof(SimulationState) for count). This
+ * would not work for non-byte-sized fields like char*, so I wanted to practice
+ * the general approach.
  */
 void MPI_simulation_state_define_layout(MPI_Datatype *MPI_state) {
-    const int N = 3; // Number of struct members
+    enum { N = 7 }; // Number of struct members
 
-    MPI_Datatype types[N] = {MPI_INT, MPI_INT, MPI_INT}; // types of the members
+    // types of the members. The engine enum is stored as an int
+    MPI_Datatype types[N] = {MPI_INT64_T,  MPI_INT,     MPI_INT, MPI_INT,
+                             MPI_UINT64_T, MPI_INT64_T, MPI_INT};
     int blocklengths[N] = {
-        1, 1, 1}; // 3 ints with length 1 (array would have length n)
+        1, 1, 1, 1, 1, 1, 1}; // All members have length 1 (array would have n)
     MPI_Aint offsets[N];
 
     // MPI doesn't know about the layout of the struct. Offsets tell MPI where
@@ -101,6 +626,10 @@ void MPI_simulation_state_define_layout(MPI_Datatype *MPI_state) {
     offsets[0] = offsetof(SimulationState, number_of_balls);
     offsets[1] = offsetof(SimulationState, number_of_compartments);
     offsets[2] = offsetof(SimulationState, number_of_rows);
+    offsets[3] = offsetof(SimulationState, engine);
+    offsets[4] = offsetof(SimulationState, seed);
+    offsets[5] = offsetof(SimulationState, first_ball);
+    offsets[6] = offsetof(SimulationState, number_of_threads);
 
     MPI_Type_create_struct(N, blocklengths, offsets, types, MPI_state);
     MPI_Type_commit(MPI_state);
@@ -127,21 +656,393 @@ SimulationState read_and_broadcast_state() {
     return state;
 }
 
+/**
+ * @brief Rough cost of a job in peg visits, only used to sort the jobs
+ */
+double estimated_cost(SimulationState state) {
+    switch (state.engine) {
+    case ENGINE_MULTINOMIAL:
+        return state.number_of_rows;
+    case ENGINE_BIT_PARALLEL:
+    case ENGINE_SIMD:
+        // 64 rows per popcount
+        return (double)state.number_of_balls * (state.number_of_rows / 64 + 1);
+    default:
+        return (double)state.number_of_balls * state.number_of_rows;
+    }
+}
+
+/**
+ * @brief Reads the jobs of a parameter sweep. Every line is one job:
+ * "balls compartments [engine [seed [threads]]]", with the defaults engine 1
+ * (bit-parallel), seed 1 and 1 thread. Empty lines and lines starting with #
+ * are skipped
+ * @return The number of jobs, -1 if the file is broken
+ */
+int read_jobs(const char *path, SimulationState **jobs) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Can't open the job file %s\n", path);
+        return -1;
+    }
+
+    int number_of_jobs = 0;
+    int capacity = 16;
+    *jobs = (SimulationState *)malloc(capacity * sizeof(SimulationState));
+    char *line = NULL;
+    size_t line_length = 0;
+    int line_number = 0;
+    while (getline(&line, &line_length, file) != EOF) {
+        ++line_number;
+        long long balls;
+        int compartments;
+        int engine = ENGINE_BIT_PARALLEL;
+        unsigned long long seed = 1;
+        int threads = 1;
+        char first;
+        if (sscanf(line, " %c", &first) != 1 || first == '#') {
+            continue;
+        }
+        int fields = sscanf(line, "%lld %d %d %llu %d", &balls, &compartments,
+                            &engine, &seed, &threads);
+        if (fields < 2 || balls <= 0 || compartments <= 1 || engine < 0 ||
+            engine >= NUMBER_OF_ENGINES || threads < 0) {
+            fprintf(stderr, "Invalid job in line %d of %s\n", line_number,
+                    path);
+            number_of_jobs = -1;
+            break;
+        }
+
+        if (number_of_jobs == capacity) {
+            capacity *= 2;
+            *jobs = (SimulationState *)realloc(
+                *jobs, capacity * sizeof(SimulationState));
+        }
+        SimulationState job = {.number_of_balls = balls,
+                               .number_of_compartments = compartments,
+                               .number_of_rows = compartments - 1,
+                               .engine = engine,
+                               .seed = seed,
+                               .first_ball = 0,
+                               .number_of_threads = threads};
+        (*jobs)[number_of_jobs++] = job;
+    }
+
+    free(line);
+    fclose(file);
+    return number_of_jobs;
+}
+
+typedef struct ScheduledJob {
+    double cost;
+    int job; // Index in the job file
+} ScheduledJob;
+
+// Jobs with the larger estimated cost first, ties in the order of the file
+int compare_scheduled_jobs(const void *a, const void *b) {
+    const ScheduledJob *first = (const ScheduledJob *)a;
+    const ScheduledJob *second = (const ScheduledJob *)b;
+    if (first->cost != second->cost) {
+        return first->cost > second->cost ? -1 : 1;
+    }
+    return first->job - second->job;
+}
+
+void write_sweep_results(const char *path, SimulationState *jobs,
+                         int number_of_jobs, int64_t *results,
+                         int64_t *offsets, double *seconds) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        printf("Can't write the results to %s\n", path);
+        return;
+    }
+
+    // One line per job, the counts of the compartments are the last columns
+    fprintf(file, "job,balls,compartments,engine,seed,threads,seconds,"
+                  "kl_divergence,histogram\n");
+    for (int job = 0; job < number_of_jobs; ++job) {
+        SimulationState state = jobs[job];
+        int64_t *histogram = results + offsets[job];
+        fprintf(file, "%d,%lld,%d,%d,%llu,%d,%.6f,%.6g", job,
+                (long long)state.number_of_balls, state.number_of_compartments,
+                state.engine, (unsigned long long)state.seed,
+                state.number_of_threads, seconds[job],
+                kl_divergence_to_exact(histogram, state));
+        for (int i = 0; i < state.number_of_compartments; ++i) {
+            fprintf(file, ",%lld", (long long)histogram[i]);
+        }
+        fprintf(file, "\n");
+    }
+
+    fclose(file);
+    printf("Wrote the results of %d jobs to %s\n", number_of_jobs, path);
+}
+
+/**
+ * @brief Runs all jobs of a job file in one MPI job. The processes are split
+ * into groups of group_size consecutive ranks, each with a communicator of its
+ * own. The jobs are sorted by their estimated cost and handed out largest
+ * first, each to the group with the least work so far. This needs no
+ * messages, every process computes the same schedule. A group splits the balls
+ * of a job among its processes like the normal mode does and reduces the
+ * histogram to its leader. At the end, the leaders reduce all results to the
+ * master, which writes them to a CSV file. Every process allocates its
+ * histogram once and reuses it for all its jobs
+ */
+void run_parameter_sweep(const char *job_file, const char *results_file,
+                         int group_size) {
+    int rank = get_rank();
+    int np = get_number_of_processes();
+    if (group_size < 1) {
+        group_size = 1;
+    }
+    if (group_size > np) {
+        group_size = np;
+    }
+
+    SimulationState *jobs = NULL;
+    int number_of_jobs = 0;
+    if (rank == 0) {
+        number_of_jobs = read_jobs(job_file, &jobs);
+    }
+    MPI_Bcast(&number_of_jobs, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (number_of_jobs <= 0) {
+        free(jobs);
+        return;
+    }
+    if (rank != 0) {
+        jobs = (SimulationState *)malloc(number_of_jobs *
+                                         sizeof(SimulationState));
+    }
+    MPI_Datatype MPI_state;
+    MPI_simulation_state_define_layout(&MPI_state);
+    MPI_Bcast(jobs, number_of_jobs, MPI_state, 0, MPI_COMM_WORLD);
+    MPI_Type_free(&MPI_state);
+
+    // Largest first, each to the group with the least work so far
+    int number_of_groups = (np + group_size - 1) / group_size;
+    ScheduledJob *order =
+        (ScheduledJob *)malloc(number_of_jobs * sizeof(ScheduledJob));
+    for (int job = 0; job < number_of_jobs; ++job) {
+        order[job].cost = estimated_cost(jobs[job]);
+        order[job].job = job;
+    }
+    qsort(order, number_of_jobs, sizeof(ScheduledJob), compare_scheduled_jobs);
+    double *group_costs = (double *)calloc(number_of_groups, sizeof(double));
+    int *assigned_group = (int *)malloc(number_of_jobs * sizeof(int));
+    for (int i = 0; i < number_of_jobs; ++i) {
+        int least_busy = 0;
+        for (int group = 1; group < number_of_groups; ++group) {
+            if (group_costs[group] < group_costs[least_busy]) {
+                least_busy = group;
+            }
+        }
+        assigned_group[order[i].job] = least_busy;
+        group_costs[least_busy] += order[i].cost;
+    }
+
+    int group = rank / group_size;
+    MPI_Comm group_communicator;
+    MPI_Comm_split(MPI_COMM_WORLD, group, rank, &group_communicator);
+    int group_rank, processes_in_group;
+    MPI_Comm_rank(group_communicator, &group_rank);
+    MPI_Comm_size(group_communicator, &processes_in_group);
+    bool leader = group_rank == 0;
+    // The master is the leader of group 0 and rank 0 here as well
+    MPI_Comm leader_communicator;
+    MPI_Comm_split(MPI_COMM_WORLD, leader ? 0 : MPI_UNDEFINED, rank,
+                   &leader_communicator);
+
+    // The results of all jobs, one histogram after another. Only the leaders
+    // need them
+    int64_t *offsets = (int64_t *)malloc(number_of_jobs * sizeof(int64_t));
+    int64_t total_size = 0;
+    int max_compartments = 0;
+    for (int job = 0; job < number_of_jobs; ++job) {
+        offsets[job] = total_size;
+        total_size += jobs[job].number_of_compartments;
+        if (jobs[job].number_of_compartments > max_compartments) {
+            max_compartments = jobs[job].number_of_compartments;
+        }
+    }
+    int64_t *results =
+        leader ? (int64_t *)calloc(total_size, sizeof(int64_t)) : NULL;
+    double *seconds =
+        leader ? (double *)calloc(number_of_jobs, sizeof(double)) : NULL;
+    int64_t *histogram = (int64_t *)malloc(max_compartments * sizeof(int64_t));
+
+    for (int i = 0; i < number_of_jobs; ++i) {
+        int job = order[i].job;
+        if (assigned_group[job] != group) {
+            continue;
+        }
+        SimulationState state = jobs[job];
+        memset(histogram, 0, state.number_of_compartments * sizeof(int64_t));
+
+        double start = MPI_Wtime();
+        simulate(split_balls(state, group_rank, processes_in_group),
+                 histogram);
+        double own_seconds = MPI_Wtime() - start;
+
+        // The group is as slow as its slowest process
+        MPI_Reduce(histogram, leader ? results + offsets[job] : NULL,
+                   state.number_of_compartments, MPI_INT64_T, MPI_SUM, 0,
+                   group_communicator);
+        MPI_Reduce(&own_seconds, leader ? &seconds[job] : NULL, 1,
+                   MPI_DOUBLE, MPI_MAX, 0, group_communicator);
+    }
+
+    if (leader) {
+        // Every job was simulated by exactly one group, the others add zeros.
+        // MPI counts are ints, so longer results go in several pieces
+        for (int64_t first = 0; first < total_size; first += INT_MAX) {
+            int count = (int)(total_size - first < INT_MAX ? total_size - first
+                                                           : INT_MAX);
+            MPI_Reduce(rank == 0 ? MPI_IN_PLACE : results + first,
+                       results + first, count, MPI_INT64_T, MPI_SUM, 0,
+                       leader_communicator);
+        }
+        MPI_Reduce(rank == 0 ? MPI_IN_PLACE : seconds, seconds,
+                   number_of_jobs, MPI_DOUBLE, MPI_SUM, 0,
+                   leader_communicator);
+        MPI_Comm_free(&leader_communicator);
+    }
+    if (rank == 0) {
+        write_sweep_results(results_file, jobs, number_of_jobs, results,
+                            offsets, seconds);
+    }
+
+    MPI_Comm_free(&group_communicator);
+    free(histogram);
+    free(seconds);
+    free(results);
+    free(offsets);
+    free(assigned_group);
+    free(group_costs);
+    free(order);
+    free(jobs);
+}
+
+Options parse_options(int argc, char **argv) {
+    Options options = {.dynamic = false,
+                       .progress_interval = 0,
+                       .tolerance = 0,
+                       .job_file = NULL,
+                       .results_file = "sweep_results.csv",
+                       .group_size = 1,
+                       .chunk_size = 0,
+                       .checkpoint_file = NULL,
+                       .restart_file = NULL};
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--dynamic") == 0) {
+            options.dynamic = true;
+        } else if (strcmp(argv[i], "--progress") == 0 && i + 1 < argc) {
+            options.progress_interval = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            options.tolerance = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--sweep") == 0 && i + 1 < argc) {
+            options.job_file = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            options.results_file = argv[++i];
+        } else if (strcmp(argv[i], "--group-size") == 0 && i + 1 < argc) {
+            options.group_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--chunk") == 0 && i + 1 < argc) {
+            options.chunk_size = atoll(argv[++i]);
+            if (options.chunk_size <= 0) {
+                options.chunk_size = INT64_MAX;
+            }
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            options.checkpoint_file = argv[++i];
+        } else if (strcmp(argv[i], "--restart") == 0 && i + 1 < argc) {
+            options.restart_file = argv[++i];
+        } else if (get_rank() == 0) {
+            printf("Ignoring unknown option %s\n", argv[i]);
+        }
+    }
+    if (options.tolerance > 0 && options.progress_interval <= 0) {
+        options.progress_interval = DEFAULT_PROGRESS_INTERVAL;
+    }
+    if (options.restart_file != NULL && options.checkpoint_file == NULL) {
+        options.checkpoint_file = options.restart_file;
+    }
+    if (options.checkpoint_file != NULL &&
+        (options.dynamic || options.progress_interval > 0)) {
+        if (get_rank() == 0) {
+            printf("Checkpoints need the static mode, ignoring --dynamic, "
+                   "--progress and --tolerance\n");
+        }
+        options.dynamic = false;
+        options.progress_interval = 0;
+        options.tolerance = 0;
+    }
+    if (options.chunk_size == 0) {
+        options.chunk_size = options.checkpoint_file != NULL
+                                 ? DEFAULT_CHECKPOINT_INTERVAL
+                                 : DEFAULT_CHUNK_SIZE;
+    }
+
+    return options;
+}
+
 /**
  * @brief Runs the galton board simulation on the number of processes specified
- * by the -np option of mpirun. The processes of rank != 0 execute the
- * simulation and the master process (rank = 0) gathers the results and displays
- * them.
+ * by the -np option of mpirun. All processes execute the simulation with
+ * OpenMP threads (hybrid MPI + threads, e.g. mpirun -np <nodes> --map-by node)
+ * and the master process (rank = 0) gathers the results and displays them.
+ * With --progress K, the partial results are gathered every K balls per
+ * process and the master shows how they converge. --tolerance T stops the
+ * simulation once they are close enough to the exact distribution. With
+ * --dynamic, the balls are handed out in chunks on request instead of being
+ * split evenly up front, which helps if the nodes differ in speed.
+ * --checkpoint FILE saves the progress of all processes after every chunk,
+ * --restart FILE continues from such a checkpoint.
+ * --sweep FILE runs many configurations in one MPI job instead, see
+ * run_parameter_sweep.
  */
-int main() {
-    MPI_Init(NULL, NULL);
+int main(int argc, char **argv) {
+    // Only the main thread of every process calls MPI, the OpenMP threads
+    // just simulate
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
 
-    SimulationState state = read_and_broadcast_state();
+    Options options = parse_options(argc, argv);
+    if (options.job_file != NULL) {
+        run_parameter_sweep(options.job_file, options.results_file,
+                            options.group_size);
+        MPI_Finalize();
+        return 0;
+    }
+    SimulationState state;
+    ProcessProgress progress = {.histogram = NULL};
+    if (options.restart_file != NULL) {
+        if (!read_checkpoint(options.restart_file, &state, &progress)) {
+            MPI_Finalize();
+            return 1;
+        }
+    } else {
+        state = read_and_broadcast_state();
+    }
 
-    if (get_rank() != 0) {
-        run_simulation_process(state);
+    if (options.dynamic) {
+        if (options.tolerance > 0 && get_rank() == 0) {
+            printf("--tolerance is ignored with --dynamic\n");
+        }
+        if (get_rank() == 0) {
+            run_dynamic_master(state);
+        } else {
+            run_dynamic_worker(state);
+        }
+    } else if (options.progress_interval > 0) {
+        run_progressive_simulation(state, options.progress_interval,
+                                   options.tolerance);
     } else {
-        gather_simulation_results(state);
+        if (progress.histogram == NULL) {
+            progress = start_process(state);
+        }
+        int64_t *histogram = run_simulation_process(
+            state, progress, options.chunk_size, options.checkpoint_file);
+        gather_simulation_results(state, histogram);
+        free(histogram);
     }
 
     MPI_Finalize();
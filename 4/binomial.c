@@ -0,0 +1,169 @@
+#include "binomial.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+/**
+ * @brief Inversion: Walks up the cumulative distribution from 0. The expected
+ * number of steps is about n * p, so this is only used for small means
+ * @note p <= 0.5
+ */
+static int64_t binomial_inversion(RandomCursor *cursor, int64_t n, double p) {
+    double q = 1.0 - p;
+    double probability_of_zero = exp(n * log(q));
+    double mean = n * p;
+    double bound = fmin(n, mean + 10.0 * sqrt(mean * q + 1));
+
+    int64_t x = 0;
+    double probability = probability_of_zero;
+    double u = random_cursor_uniform(cursor);
+    while (u > probability) {
+        ++x;
+        if (x > bound) {
+            // Lost in the far tail due to rounding, start over
+            x = 0;
+            probability = probability_of_zero;
+            u = random_cursor_uniform(cursor);
+        } else {
+            u -= probability;
+            probability = ((n - x + 1) * p * probability) / (x * q);
+        }
+    }
+
+    return x;
+}
+
+/**
+ * @brief BTPE (Kachitvichyanukul and Schmeiser, "Binomial random variate
+ * generation", 1988): Samples from a hat function made of a triangle, two
+ * parallelograms and two exponential tails, with squeezes that accept most
+ * samples without evaluating the exact density. The expected number of
+ * uniforms per sample is bounded independently of n
+ * @note p <= 0.5 and n * p >= 30
+ */
+static int64_t binomial_btpe(RandomCursor *cursor, int64_t n, double p) {
+    double q = 1.0 - p;
+    double nrq = n * p * q;
+    double fm = n * p + p;
+    int64_t m = (int64_t)floor(fm);
+    double p1 = floor(2.195 * sqrt(nrq) - 4.6 * q) + 0.5;
+    double xm = m + 0.5;
+    double xl = xm - p1;
+    double xr = xm + p1;
+    double c = 0.134 + 20.5 / (15.3 + m);
+    double a = (fm - xl) / (fm - xl * p);
+    double lambda_left = a * (1.0 + a / 2.0);
+    a = (xr - fm) / (xr * q);
+    double lambda_right = a * (1.0 + a / 2.0);
+    double p2 = p1 * (1.0 + 2.0 * c);
+    double p3 = p2 + c / lambda_left;
+    double p4 = p3 + c / lambda_right;
+
+    for (;;) {
+        double u = random_cursor_uniform(cursor) * p4;
+        double v = random_cursor_uniform(cursor);
+        int64_t y;
+
+        if (u <= p1) {
+            // Triangular region, always accepted
+            return (int64_t)floor(xm - p1 * v + u);
+        }
+        if (u <= p2) {
+            // Parallelograms
+            double x = xl + (u - p1) / c;
+            v = v * c + 1.0 - fabs(m - x + 0.5) / p1;
+            if (v > 1.0) {
+                continue;
+            }
+            y = (int64_t)floor(x);
+        } else if (u <= p3) {
+            // Left exponential tail
+            y = (int64_t)floor(xl + log(v) / lambda_left);
+            if (y < 0 || v == 0.0) {
+                continue;
+            }
+            v = v * (u - p2) * lambda_left;
+        } else {
+            // Right exponential tail
+            y = (int64_t)floor(xr - log(v) / lambda_right);
+            if (y > n || v == 0.0) {
+                continue;
+            }
+            v = v * (u - p3) * lambda_right;
+        }
+
+        int64_t k = llabs(y - m);
+        if (k <= 20 || k >= nrq / 2.0 - 1) {
+            // Close to the mode: Evaluate f(y) / f(m) with the recurrence
+            double s = p / q;
+            double b = s * (n + 1);
+            double f = 1.0;
+            for (int64_t i = m + 1; i <= y; ++i) {
+                f *= b / i - s;
+            }
+            for (int64_t i = y + 1; i <= m; ++i) {
+                f /= b / i - s;
+            }
+            if (v <= f) {
+                return y;
+            }
+            continue;
+        }
+
+        // Squeeze with bounds on log(f(y) / f(m))
+        double rho =
+            (k / nrq) * ((k * (k / 3.0 + 0.625) + 1.0 / 6.0) / nrq + 0.5);
+        double t = -(double)k * k / (2 * nrq);
+        double log_v = log(v);
+        if (log_v < t - rho) {
+            return y;
+        }
+        if (log_v > t + rho) {
+            continue;
+        }
+
+        // Final comparison with Stirling's formula
+        double x1 = y + 1;
+        double f1 = m + 1;
+        double z = n + 1 - m;
+        double w = n - y + 1;
+        double x2 = x1 * x1;
+        double f2 = f1 * f1;
+        double z2 = z * z;
+        double w2 = w * w;
+        double bound =
+            xm * log(f1 / x1) + (n - m + 0.5) * log(z / w) +
+            (y - m) * log(w * p / (x1 * q)) +
+            (13860. - (462. - (132. - (99. - 140. / f2) / f2) / f2) / f2) / f1 /
+                166320. +
+            (13860. - (462. - (132. - (99. - 140. / z2) / z2) / z2) / z2) / z /
+                166320. +
+            (13860. - (462. - (132. - (99. - 140. / x2) / x2) / x2) / x2) / x1 /
+                166320. +
+            (13860. - (462. - (132. - (99. - 140. / w2) / w2) / w2) / w2) / w /
+                166320.;
+        if (log_v <= bound) {
+            return y;
+        }
+    }
+}
+
+/**
+ * @brief Number of successes in n independent trials with success probability
+ * p. Uses inversion for small means and BTPE otherwise
+ */
+int64_t sample_binomial(RandomCursor *cursor, int64_t n, double p) {
+    if (n <= 0 || p <= 0.0) {
+        return 0;
+    }
+    if (p >= 1.0) {
+        return n;
+    }
+
+    // Both methods need p <= 0.5, the other half follows by symmetry
+    double r = p <= 0.5 ? p : 1.0 - p;
+    int64_t x = n * r < 30.0 ? binomial_inversion(cursor, n, r)
+                             : binomial_btpe(cursor, n, r);
+
+    return p <= 0.5 ? x : n - x;
+}
@@ -0,0 +1,11 @@
+// Binomial random variates for the multinomial engine
+#ifndef BINOMIAL_H_INCLUDED
+#define BINOMIAL_H_INCLUDED
+
+#include "philox.h"
+
+#include <stdint.h>
+
+int64_t sample_binomial(RandomCursor *cursor, int64_t n, double p);
+
+#endif
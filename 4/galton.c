@@ -1,21 +1,50 @@
 // Implementation was copy-pasted from exercise 1.1. Some comments were removed.
 
 #include "galton.h"
+#include "binomial.h"
+#include "galton_simd.h"
+#include "galton_wavefront.h"
+#include "philox.h"
 
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 const int EMPTY = -1;
 
-bool ball_goes_right() { return rand() % 2 == 0; }
+/**
+ * @brief Every ball owns ceil(number_of_rows / 32) consecutive words of the
+ * shared ball stream. Bit r of them decides whether the ball goes right in row
+ * r. Because the bits only depend on the seed and the global ball index, all
+ * engines and any split of the balls among processes or threads give the same
+ * histogram
+ */
+int random_words_per_ball(int number_of_rows) {
+    return (number_of_rows + 31) / 32;
+}
 
-void set_random_seed() { srand(time(0)); }
+RandomStream ball_stream(SimulationState state) {
+    return random_stream_create(state.seed, SHARED_STREAM, SHARED_STREAM);
+}
+
+// The random word that decides the rows 32 * word, ..., 32 * word + 31
+uint32_t ball_random_word(RandomStream stream, int64_t ball, int word,
+                          SimulationState state) {
+    uint64_t index =
+        (uint64_t)ball * random_words_per_ball(state.number_of_rows) + word;
+    return random_stream_word(stream, index);
+}
 
-int safely_read_integer() {
-    int integer;
+int64_t safely_read_integer() {
+    long long integer;
     char *input = NULL;
     size_t input_length = 0;
     ssize_t getline_return = EOF;
@@ -33,131 +62,500 @@ int safely_read_integer() {
         printf(">> ");
         getline_return = getline(&input, &input_length, stdin);
         sscanf_return =
-            sscanf(input, "%d%c", &integer, &character_after_number);
+            sscanf(input, "%lld%c", &integer, &character_after_number);
     }
 
     return integer;
 }
 
-void init_array_with(int *array, size_t size, int value) {
-    for (size_t i = 0; i < size; ++i) {
-        array[i] = value;
+void display_histogram(int64_t *histogram, SimulationState state) {
+    int64_t max = EMPTY;
+    for (int i = 0; i < state.number_of_compartments; ++i) {
+        if (histogram[i] > max) {
+            max = histogram[i];
+        }
     }
-}
 
-void count_and_clear_last_row(int **board, int *histogram,
-                              SimulationState state) {
-    int *last_row = board[state.number_of_rows - 1];
-    for (int i = 0; i < state.number_of_compartments; ++i) {
-        if (last_row[i] != EMPTY) {
-            ++histogram[i];
-            last_row[i] = EMPTY;
-            return;
+    int64_t number_of_balls_per_X = max / state.number_of_compartments;
+    if (number_of_balls_per_X < 1) {
+        number_of_balls_per_X = 1;
+    }
+    for (int i = state.number_of_compartments; i > -1; --i) {
+        for (int j = 0; j < state.number_of_compartments; ++j) {
+            if (histogram[j] >= (i + 1) * number_of_balls_per_X) {
+                printf("X ");
+            } else {
+                if (i == 0) {
+                    printf("- ");
+                } else {
+                    printf("  ");
+                }
+            }
         }
+        printf("\n");
+    }
+
+    printf("\nX = %lld balls. Underlying histogram:\n",
+           (long long)number_of_balls_per_X);
+    for (int i = 0; i < state.number_of_compartments; ++i) {
+        printf("%lld ", (long long)histogram[i]);
     }
 }
 
-void let_balls_fall_1_row(int **board, SimulationState state) {
-    for (int i = state.number_of_rows - 1; i > 0; --i) {
-        int *row_above = board[i - 1];
-        int size_of_row_above = i + 1;
+/**
+ * @brief The board only stores the balls that are in flight: One entry per
+ * row, in a ring buffer indexed by the time step a ball entered the board.
+ * Every time step, one ball enters and every ball falls one row, so the ball
+ * that entered k steps ago is in row k. Its entry is at (time_step - k) mod
+ * number_of_rows and no row has to be searched.
+ * A board can also be a band of rows first_row, ..., first_row +
+ * number_of_rows - 1 of a taller board (see galton_wavefront.c)
+ */
+Board create_board(int first_row, int number_of_rows) {
+    Board board = {.first_row = first_row,
+                   .number_of_rows = number_of_rows,
+                   .time_step = 0};
+    board.entries = (BoardEntry *)malloc(number_of_rows * sizeof(BoardEntry));
+    for (int i = 0; i < number_of_rows; ++i) {
+        board.entries[i].ball = EMPTY;
+    }
+
+    return board;
+}
 
-        // Get the index and ball number of the ball in the row above
-        int ball_number;
-        int index_of_ball_above = -1;
-        for (int j = 0; j < size_of_row_above; ++j) {
-            if (row_above[j] != EMPTY) {
-                ball_number = row_above[j];
-                index_of_ball_above = j;
-                break;
-            }
+void destroy_board(Board *board) {
+    free(board->entries);
+    board->entries = NULL;
+}
+
+/**
+ * @brief Lets the ball of an entry fall through row `row`. The entry keeps the
+ * random word of the ball for the current 32 rows, so the generator only runs
+ * once every 32 rows
+ */
+static inline void let_ball_fall(BoardEntry *entry, int row,
+                                 RandomStream stream, SimulationState state) {
+    if (row % 32 == 0) {
+        entry->random_bits =
+            ball_random_word(stream, entry->ball, row / 32, state);
+    }
+    entry->column += (entry->random_bits >> (row % 32)) & 1;
+}
+
+/**
+ * @brief One time step: Inserts `incoming` at the top (unless its ball is
+ * EMPTY) and lets every ball fall one row. O(rows)
+ * @return The ball that left the last row, or an entry with an EMPTY ball
+ */
+BoardEntry board_step(Board *board, BoardEntry incoming, RandomStream stream,
+                      SimulationState state) {
+    int rows = board->number_of_rows;
+    int newest = (int)(board->time_step % rows);
+    // The previous ball in this entry left the board in the last step
+    board->entries[newest] = incoming;
+
+    BoardEntry outgoing = {.ball = EMPTY};
+    // Entries newest, newest - 1, ..., 0, rows - 1, ..., newest + 1 hold the
+    // balls in rows 0, 1, ..., rows - 1
+    for (int row = 0; row < rows; ++row) {
+        int slot = newest - row;
+        if (slot < 0) {
+            slot += rows;
         }
-        if (index_of_ball_above == -1) {
-            // No ball in the above row, continue
+        BoardEntry *entry = &board->entries[slot];
+        if (entry->ball == EMPTY) {
             continue;
         }
 
-        // Determine the new index of the ball in the current row
-        int new_index = index_of_ball_above;
-        if (ball_goes_right()) {
-            new_index = index_of_ball_above + 1;
+        let_ball_fall(entry, board->first_row + row, stream, state);
+        if (row == rows - 1) {
+            outgoing = *entry;
+            entry->ball = EMPTY;
         }
+    }
+
+    ++board->time_step;
+    return outgoing;
+}
 
-        // Assign the ball to the new index and remove it from the old
-        int *current_row = board[i];
-        current_row[new_index] = ball_number;
-        row_above[index_of_ball_above] = EMPTY;
+int64_t *create_histogram(SimulationState state) {
+    return (int64_t *)calloc(state.number_of_compartments, sizeof(int64_t));
+}
+
+void simulate_board(SimulationState state, int64_t *histogram) {
+    RandomStream stream = ball_stream(state);
+    Board board = create_board(0, state.number_of_rows);
+
+    int64_t number_of_iterations =
+        state.number_of_balls + state.number_of_rows;
+    for (int64_t i = 0; i < number_of_iterations; ++i) {
+        // The board stores the global ball index, it selects the random bits
+        BoardEntry incoming = {
+            .ball = i < state.number_of_balls ? state.first_ball + i : EMPTY,
+            .column = 0};
+        BoardEntry outgoing = board_step(&board, incoming, stream, state);
+        if (outgoing.ball != EMPTY) {
+            ++histogram[outgoing.column];
+        }
     }
+
+    destroy_board(&board);
 }
 
-void insert_ball_at_top(int **board, SimulationState state) {
-    if (state.number_of_balls <= 0) {
-        return;
+/**
+ * @brief The compartment a ball lands in is the number of times it went right,
+ * so a ball is fully described by its random words. They are counted 64 bits at
+ * a time with a single popcount instruction
+ */
+int count_right_turns(const uint32_t *words, int number_of_rows) {
+    int right_turns = 0;
+    for (; number_of_rows >= 64; number_of_rows -= 64, words += 2) {
+        right_turns +=
+            __builtin_popcountll(words[0] | (uint64_t)words[1] << 32);
+    }
+    if (number_of_rows > 0) {
+        uint64_t bits = words[0];
+        if (number_of_rows > 32) {
+            bits |= (uint64_t)words[1] << 32;
+        }
+        uint64_t mask = (UINT64_C(1) << number_of_rows) - 1;
+        right_turns += __builtin_popcountll(bits & mask);
     }
-    int index = ball_goes_right() ? 1 : 0;
-    board[0][index] = state.number_of_balls;
+
+    return right_turns;
+}
+
+// Number of balls whose random words are generated together
+#define BALLS_PER_BATCH 256
+
+/**
+ * @brief Same result as simulate_board, but skips the board: The cost per ball
+ * is O(number_of_rows / 64) instead of O(number_of_rows^2)
+ */
+void simulate_bit_parallel(SimulationState state, int64_t *histogram) {
+    RandomStream stream = ball_stream(state);
+    int words_per_ball = random_words_per_ball(state.number_of_rows);
+    uint32_t *words =
+        (uint32_t *)malloc(BALLS_PER_BATCH * words_per_ball * sizeof(uint32_t));
+
+    for (int64_t done = 0; done < state.number_of_balls;
+         done += BALLS_PER_BATCH) {
+        int batch = BALLS_PER_BATCH;
+        if (state.number_of_balls - done < BALLS_PER_BATCH) {
+            batch = (int)(state.number_of_balls - done);
+        }
+        uint64_t first_word =
+            (uint64_t)(state.first_ball + done) * words_per_ball;
+        random_stream_fill(stream, first_word, words, batch * words_per_ball);
+
+        for (int i = 0; i < batch; ++i) {
+            ++histogram[count_right_turns(words + i * words_per_ball,
+                                          state.number_of_rows)];
+        }
+    }
+
+    free(words);
+}
+
+/**
+ * @brief The exact distribution of the compartments: A ball lands in
+ * compartment k with probability binomial(number_of_rows, k) / 2^number_of_rows
+ */
+double *binomial_probabilities(SimulationState state) {
+    int n = state.number_of_rows;
+    double *probabilities =
+        (double *)malloc(state.number_of_compartments * sizeof(double));
+    for (int k = 0; k <= n; ++k) {
+        // In log space, 2^n and the binomial coefficient overflow for large n
+        probabilities[k] = exp(lgamma(n + 1.0) - lgamma(k + 1.0) -
+                               lgamma(n - k + 1.0) - n * log(2.0));
+    }
+
+    return probabilities;
 }
 
-void display_histogram(int *histogram, SimulationState state) {
-    int max = EMPTY;
+/**
+ * @brief Pearson's chi-square statistic of a histogram of
+ * state.number_of_balls balls against the given distribution of the
+ * compartments. Compartments expecting less than 5 balls are skipped
+ * @param degrees_of_freedom Set to the number of used compartments - 1
+ */
+double chi_square_to_distribution(int64_t *histogram,
+                                  const double *probabilities,
+                                  SimulationState state,
+                                  int *degrees_of_freedom) {
+    double chi_square = 0;
+    *degrees_of_freedom = -1;
     for (int i = 0; i < state.number_of_compartments; ++i) {
-        if (histogram[i] > max) {
-            max = histogram[i];
+        double expected = probabilities[i] * state.number_of_balls;
+        if (expected >= 5) {
+            double difference = histogram[i] - expected;
+            chi_square += difference * difference / expected;
+            ++*degrees_of_freedom;
         }
     }
+    return chi_square;
+}
 
-    int number_of_balls_per_X = (int)round(max / state.number_of_compartments);
-    if (number_of_balls_per_X < 1) {
-        number_of_balls_per_X = 1;
+// chi_square_to_distribution against the exact binomial distribution
+double chi_square_to_exact(int64_t *histogram, SimulationState state,
+                           int *degrees_of_freedom) {
+    double *probabilities = binomial_probabilities(state);
+    double chi_square = chi_square_to_distribution(histogram, probabilities,
+                                                   state, degrees_of_freedom);
+    free(probabilities);
+    return chi_square;
+}
+
+/**
+ * @brief Kullback-Leibler divergence of the exact distribution from the
+ * histogram of state.number_of_balls balls, in nats. For a correct engine it
+ * shrinks like (number_of_compartments - 1) / (2 * number_of_balls), unlike the
+ * chi-square statistic, so it tells how far the histogram has converged
+ */
+double kl_divergence_to_exact(int64_t *histogram, SimulationState state) {
+    double *probabilities = binomial_probabilities(state);
+    double divergence = 0;
+    for (int i = 0; i < state.number_of_compartments; ++i) {
+        if (histogram[i] > 0) {
+            double observed = (double)histogram[i] / state.number_of_balls;
+            divergence += observed * log(observed / probabilities[i]);
+        }
     }
-    for (int i = state.number_of_compartments; i > -1; --i) {
-        for (int j = 0; j < state.number_of_compartments; ++j) {
-            if (histogram[j] >= (i + 1) * number_of_balls_per_X) {
-                printf("X ");
-            } else {
-                if (i == 0) {
-                    printf("- ");
-                } else {
-                    printf("  ");
+    free(probabilities);
+    return divergence;
+}
+
+/**
+ * @brief Samples the histogram of all balls at once instead of simulating them.
+ * The histogram is multinomially distributed, so the compartments can be drawn
+ * one after another: Compartment k gets Binomial(remaining balls, p_k / (p_k +
+ * ... + p_n)) balls. The cost is O(number_of_compartments), independent of the
+ * number of balls
+ * @note The result has the right distribution but is not the histogram of the
+ * board engines for the same seed. Its random numbers come from a stream of
+ * its own, selected by first_ball, so every process draws different numbers
+ */
+void simulate_multinomial(SimulationState state, int64_t *histogram) {
+    double *probabilities = binomial_probabilities(state);
+
+    // Suffix sums are more accurate than subtracting from 1 over and over
+    double *remaining_probability =
+        (double *)malloc(state.number_of_compartments * sizeof(double));
+    double sum = 0;
+    for (int k = state.number_of_rows; k >= 0; --k) {
+        sum += probabilities[k];
+        remaining_probability[k] = sum;
+    }
+
+    // The upper half of first_ball changes the stream as well, so workers
+    // 2^32 balls apart don't draw the same numbers
+    RandomCursor cursor = random_cursor_create(
+        random_stream_create(state.seed, (uint32_t)state.first_ball,
+                             MULTINOMIAL_STREAM ^
+                                 (uint32_t)(state.first_ball >> 32)),
+        0);
+    int64_t remaining_balls = state.number_of_balls;
+    for (int k = 0; k < state.number_of_rows && remaining_balls > 0; ++k) {
+        double p = probabilities[k] / remaining_probability[k];
+        int64_t balls = sample_binomial(&cursor, remaining_balls, p);
+        histogram[k] += balls;
+        remaining_balls -= balls;
+    }
+    histogram[state.number_of_rows] += remaining_balls;
+
+    free(remaining_probability);
+    free(probabilities);
+}
+
+const char *engine_description(SimulationEngine engine) {
+    switch (engine) {
+    case ENGINE_BOARD:
+        return "Let every ball fall through the board row by row";
+    case ENGINE_BIT_PARALLEL:
+        return "Count the right turns of every ball with popcount (fast)";
+    case ENGINE_SIMD:
+        return "Bit-parallel with AVX2/AVX-512 if available (fastest)";
+    case ENGINE_MULTINOMIAL:
+        return "Sample the histogram directly, cost independent of the balls";
+    case ENGINE_WAVEFRONT:
+        return "Board split into bands of rows, one thread per band";
+    default:
+        return "Unknown engine";
+    }
+}
+
+/**
+ * @brief The number of chunks of at most chunk_size balls needed for
+ * number_of_balls balls. Without the usual (n + size - 1) / size, which
+ * overflows for chunk_size = INT64_MAX ("no chunking")
+ */
+int64_t number_of_chunks(int64_t number_of_balls, int64_t chunk_size) {
+    return number_of_balls / chunk_size +
+           (number_of_balls % chunk_size != 0);
+}
+
+/**
+ * @brief Gives worker number `worker` (0, ..., number_of_workers - 1) its share
+ * of the balls. The first number_of_balls % number_of_workers workers take 1
+ * extra ball. first_ball is set so that the shares are consecutive
+ */
+SimulationState split_balls(SimulationState state, int worker,
+                            int number_of_workers) {
+    int64_t share = state.number_of_balls / number_of_workers;
+    int64_t remainder = state.number_of_balls % number_of_workers;
+
+    state.first_ball +=
+        worker * share + (worker < remainder ? worker : remainder);
+    state.number_of_balls = share + (worker < remainder ? 1 : 0);
+
+    return state;
+}
+
+void simulate_single_thread(SimulationState state, int64_t *histogram) {
+    switch (state.engine) {
+    case ENGINE_BIT_PARALLEL:
+        simulate_bit_parallel(state, histogram);
+        break;
+    case ENGINE_SIMD:
+        simulate_simd(state, best_instruction_set(), histogram);
+        break;
+    case ENGINE_MULTINOMIAL:
+        simulate_multinomial(state, histogram);
+        break;
+    case ENGINE_BOARD:
+    default:
+        simulate_board(state, histogram);
+        break;
+    }
+}
+
+#ifdef _OPENMP
+// Per-thread histograms start on their own cache line, so the threads never
+// write to the same line while simulating
+#define CACHE_LINE_SIZE 64
+
+int padded_histogram_length(SimulationState state) {
+    const int counts_per_line = CACHE_LINE_SIZE / sizeof(int64_t);
+    return (state.number_of_compartments + counts_per_line - 1) /
+           counts_per_line * counts_per_line;
+}
+
+/**
+ * @brief Every thread simulates a consecutive share of the balls into its own
+ * histogram. The histograms are then merged in log2(threads) steps: In step s,
+ * thread t adds the histogram of thread t + 2^s if t is a multiple of 2^(s+1)
+ */
+void simulate_threaded(SimulationState state, int number_of_threads,
+                       int64_t *histogram) {
+    int length = padded_histogram_length(state);
+    size_t bytes = (size_t)number_of_threads * length * sizeof(int64_t);
+    int64_t *thread_histograms =
+        (int64_t *)aligned_alloc(CACHE_LINE_SIZE, bytes);
+    memset(thread_histograms, 0, bytes);
+
+#pragma omp parallel num_threads(number_of_threads)
+    {
+        int thread = omp_get_thread_num();
+        int threads = omp_get_num_threads();
+        int64_t *own = thread_histograms + thread * length;
+
+        simulate_single_thread(split_balls(state, thread, threads), own);
+
+        for (int distance = 1; distance < threads; distance *= 2) {
+#pragma omp barrier
+            if (thread % (2 * distance) == 0 && thread + distance < threads) {
+                int64_t *other = own + distance * length;
+                for (int i = 0; i < state.number_of_compartments; ++i) {
+                    own[i] += other[i];
                 }
             }
         }
-        printf("\n");
     }
 
-    printf("\nX = %d balls. Underlying histogram:\n", number_of_balls_per_X);
     for (int i = 0; i < state.number_of_compartments; ++i) {
-        printf("%d ", histogram[i]);
+        histogram[i] += thread_histograms[i];
     }
+    free(thread_histograms);
+}
+#endif
+
+/**
+ * @brief number_of_threads = 0 means one thread per core. Without OpenMP,
+ * there is always 1 thread
+ */
+int resolve_number_of_threads(SimulationState state) {
+#ifdef _OPENMP
+    return state.number_of_threads > 0 ? state.number_of_threads
+                                       : omp_get_max_threads();
+#else
+    return 1;
+#endif
 }
 
-int **create_board(SimulationState state) {
-    int **board = (int **)malloc(state.number_of_rows * sizeof(int *));
-    for (size_t i = 0; i < state.number_of_rows; ++i) {
-        size_t size = i + 2;
-        board[i] = (int *)malloc(size * sizeof(int));
-        init_array_with(board[i], size, EMPTY);
+/**
+ * @brief Adds the balls of state (first_ball, ..., first_ball + number_of_balls
+ * - 1) to the histogram, using number_of_threads threads
+ */
+void simulate(SimulationState state, int64_t *histogram) {
+    int number_of_threads = resolve_number_of_threads(state);
+    if (number_of_threads > state.number_of_balls) {
+        number_of_threads = state.number_of_balls;
+    }
+    if (state.engine == ENGINE_MULTINOMIAL) {
+        // Nothing to split, the cost doesn't depend on the number of balls
+        number_of_threads = 1;
+    }
+    if (state.engine == ENGINE_WAVEFRONT) {
+        // The threads split the rows instead of the balls
+        simulate_wavefront(state, resolve_number_of_threads(state), histogram);
+        return;
     }
 
-    return board;
+#ifdef _OPENMP
+    if (number_of_threads > 1) {
+        simulate_threaded(state, number_of_threads, histogram);
+        return;
+    }
+#endif
+    simulate_single_thread(state, histogram);
 }
 
-int *run_simulation(SimulationState state) {
-    set_random_seed();
-    int **board = create_board(state);
+int64_t *run_simulation(SimulationState state) {
+    int64_t *histogram = create_histogram(state);
+    simulate(state, histogram);
+
+    return histogram;
+}
 
-    int *histogram = (int *)malloc(state.number_of_compartments * sizeof(int));
-    init_array_with(histogram, state.number_of_compartments, 0);
+/**
+ * @brief Simulates the balls of state in steps of check_interval balls, until
+ * the KL divergence of the histogram from the exact distribution is at most
+ * tolerance or all balls have fallen. The simulated balls are the first ones
+ * of state, so the result is the histogram of run_simulation for fewer balls
+ * @param histogram Has to be empty, receives the simulated balls
+ * @return The number of balls that were simulated
+ */
+int64_t simulate_until_converged(SimulationState state, double tolerance,
+                                 int64_t check_interval, int64_t *histogram) {
+    SimulationState done = state;
+    done.number_of_balls = 0;
+    while (done.number_of_balls < state.number_of_balls) {
+        SimulationState chunk = state;
+        chunk.first_ball += done.number_of_balls;
+        chunk.number_of_balls = state.number_of_balls - done.number_of_balls;
+        if (chunk.number_of_balls > check_interval) {
+            chunk.number_of_balls = check_interval;
+        }
+        simulate(chunk, histogram);
+        done.number_of_balls += chunk.number_of_balls;
 
-    int number_of_iterations = state.number_of_balls + state.number_of_rows;
-    for (int i = 0; i < number_of_iterations; ++i) {
-        insert_ball_at_top(board, state);
-        let_balls_fall_1_row(board, state);
-        count_and_clear_last_row(board, histogram, state);
-        --state.number_of_balls;
+        if (kl_divergence_to_exact(histogram, done) <= tolerance) {
+            break;
+        }
     }
 
-    return histogram;
+    return done.number_of_balls;
 }
 
 SimulationState read_simulation_state() {
@@ -177,14 +575,47 @@ SimulationState read_simulation_state() {
            "terminal to display the histogram correctly.\n");
     while (state.number_of_compartments <= 1) {
         printf("The number of compartments has to be greater than 1.\n");
-        state.number_of_compartments = safely_read_integer();
+        state.number_of_compartments = (int)safely_read_integer();
     }
     state.number_of_rows = state.number_of_compartments - 1;
 
+    printf("Finally, choose the simulation engine.\n");
+    for (int i = 0; i < NUMBER_OF_ENGINES; ++i) {
+        printf("%d: %s\n", i, engine_description(i));
+    }
+    int engine = -1;
+    while (engine < 0 || engine >= NUMBER_OF_ENGINES) {
+        printf("The engine has to be one of the numbers above.\n");
+        engine = (int)safely_read_integer();
+    }
+    state.engine = engine;
+
+    printf("Type in a seed. The same seed always gives the same histogram, 0 "
+           "uses the current time.\n");
+    int64_t seed = -1;
+    while (seed < 0) {
+        printf("The seed can't be negative.\n");
+        seed = safely_read_integer();
+    }
+    state.seed = seed != 0 ? (uint64_t)seed : (uint64_t)time(0);
+    state.first_ball = 0;
+
+    printf("How many threads should every process use? 0 uses all cores.\n");
+    state.number_of_threads = -1;
+    while (state.number_of_threads < 0) {
+        printf("The number of threads can't be negative.\n");
+        state.number_of_threads = (int)safely_read_integer();
+    }
+
     printf("\nRunning simulation with: \n"
-           "Number of balls: %d\n"
-           "Number of compartments: %d\n\n",
-           state.number_of_balls, state.number_of_compartments);
+           "Number of balls: %lld\n"
+           "Number of compartments: %d\n"
+           "Engine: %s\n"
+           "Seed: %llu\n"
+           "Threads per process: %d\n\n",
+           (long long)state.number_of_balls, state.number_of_compartments,
+           engine_description(state.engine), (unsigned long long)state.seed,
+           state.number_of_threads);
 
     return state;
 }
\ No newline at end of file
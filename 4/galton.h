@@ -3,14 +3,75 @@
 #ifndef GALTON_H_INCLUDED
 #define GALTON_H_INCLUDED
 
+#include "philox.h"
+
+#include <stdint.h>
+
+typedef enum SimulationEngine {
+    ENGINE_BOARD,        // Every ball falls through the board row by row
+    ENGINE_BIT_PARALLEL, // Every ball is the popcount of number_of_rows bits
+    ENGINE_SIMD,         // Bit-parallel with the widest available vector unit
+    ENGINE_MULTINOMIAL,  // Samples the histogram without simulating balls
+    ENGINE_WAVEFRONT,    // Board pipeline with bands of rows on threads
+    NUMBER_OF_ENGINES
+} SimulationEngine;
+
 typedef struct SimulationState {
-    int number_of_balls;
+    int64_t number_of_balls; // 64 bits, convergence studies need > 2^31 balls
     int number_of_compartments;
     int number_of_rows; // This is always number_of_compartments - 1
+    SimulationEngine engine;
+    uint64_t seed;  // Same seed and balls -> same histogram
+    int64_t first_ball; // Global index of the first ball of this worker
+    int number_of_threads; // Per process, 0 = one per core
 } SimulationState;
 
-void display_histogram(int *histogram, SimulationState state);
-int *run_simulation(SimulationState state);
+extern const int EMPTY;
+
+// A ball in flight. The row follows from the time step it entered the board
+typedef struct BoardEntry {
+    int64_t ball; // Global ball index, EMPTY (-1) if the entry is unused
+    int column;   // Position within its row
+    uint32_t random_bits; // Random word for the ball's current 32 rows
+} BoardEntry;
+
+typedef struct Board {
+    BoardEntry *entries; // One per row, a ring buffer indexed by time step
+    int first_row;       // > 0 if the board is a band of a taller board
+    int number_of_rows;
+    int64_t time_step; // A board runs number_of_balls + rows steps
+} Board;
+
+void display_histogram(int64_t *histogram, SimulationState state);
+// Counter word 3 of the streams of the multinomial engine
+#define MULTINOMIAL_STREAM 0x4D4E4F4D
+
+int random_words_per_ball(int number_of_rows);
+RandomStream ball_stream(SimulationState state);
+const char *engine_description(SimulationEngine engine);
+int64_t *create_histogram(SimulationState state);
+int64_t number_of_chunks(int64_t number_of_balls, int64_t chunk_size);
+SimulationState split_balls(SimulationState state, int worker,
+                            int number_of_workers);
+Board create_board(int first_row, int number_of_rows);
+void destroy_board(Board *board);
+BoardEntry board_step(Board *board, BoardEntry incoming, RandomStream stream,
+                      SimulationState state);
+void simulate_board(SimulationState state, int64_t *histogram);
+void simulate_bit_parallel(SimulationState state, int64_t *histogram);
+double *binomial_probabilities(SimulationState state);
+double chi_square_to_distribution(int64_t *histogram,
+                                  const double *probabilities,
+                                  SimulationState state,
+                                  int *degrees_of_freedom);
+double chi_square_to_exact(int64_t *histogram, SimulationState state,
+                           int *degrees_of_freedom);
+double kl_divergence_to_exact(int64_t *histogram, SimulationState state);
+void simulate_multinomial(SimulationState state, int64_t *histogram);
+void simulate(SimulationState state, int64_t *histogram);
+int64_t *run_simulation(SimulationState state);
+int64_t simulate_until_converged(SimulationState state, double tolerance,
+                                 int64_t check_interval, int64_t *histogram);
 SimulationState read_simulation_state();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,118 @@
+// Compiled and executed with gcc -o galton_benchmark galton_benchmark.c
+// galton.c galton_simd.c galton_wavefront.c galton_pegs.c philox.c binomial.c
+// -Wall -O3 -fopenmp -lm && ./galton_benchmark
+#include "galton.h"
+#include "galton_pegs.h"
+#include "galton_simd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+double seconds_since(struct timespec start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+/**
+ * @brief Runs the bit-parallel engine with every instruction set the CPU
+ * supports and prints the balls per second. The histograms of all instruction
+ * sets have to be identical, otherwise the kernel is broken
+ */
+void benchmark_instruction_sets(int64_t number_of_balls,
+                                int number_of_compartments) {
+    SimulationState state = {.number_of_balls = number_of_balls,
+                             .number_of_compartments = number_of_compartments,
+                             .number_of_rows = number_of_compartments - 1,
+                             .engine = ENGINE_SIMD,
+                             .seed = 1,
+                             .first_ball = 0};
+    int64_t *reference = NULL;
+
+    for (int isa = 0; isa < NUMBER_OF_INSTRUCTION_SETS; ++isa) {
+        if (!instruction_set_supported(isa)) {
+            printf("%-8s %6d rows: not supported\n", instruction_set_name(isa),
+                   state.number_of_rows);
+            continue;
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int64_t *histogram = run_simulation_simd(state, isa);
+        double seconds = seconds_since(start);
+
+        bool matches = reference == NULL ||
+                       memcmp(reference, histogram,
+                              number_of_compartments * sizeof(int64_t)) == 0;
+        printf("%-8s %6d rows: %8.3f s, %10.3e balls/s%s\n",
+               instruction_set_name(isa), state.number_of_rows, seconds,
+               number_of_balls / seconds, matches ? "" : " (MISMATCH)");
+
+        if (reference == NULL) {
+            reference = histogram;
+        } else {
+            free(histogram);
+        }
+    }
+
+    free(reference);
+}
+
+/**
+ * @brief Compares the peg map engines on a fair map with the fair board and
+ * bit-parallel engines. They need a random word per row instead of a bit, so
+ * they can't be as fast as the bit-parallel engine, but they should stay
+ * within a small factor
+ */
+void benchmark_peg_maps(int64_t number_of_balls, int number_of_compartments) {
+    SimulationState state = {.number_of_balls = number_of_balls,
+                             .number_of_compartments = number_of_compartments,
+                             .number_of_rows = number_of_compartments - 1,
+                             .engine = ENGINE_BOARD,
+                             .seed = 1,
+                             .first_ball = 0,
+                             .number_of_threads = 1};
+    PegMap map = create_peg_map(state.number_of_rows, 0.5);
+    const char *names[] = {"board", "popcount", "pegs", "batched"};
+
+    for (int engine = 0; engine < 4; ++engine) {
+        int64_t *histogram = create_histogram(state);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (engine == 0) {
+            simulate_board(state, histogram);
+        } else if (engine == 1) {
+            simulate_bit_parallel(state, histogram);
+        } else if (engine == 2) {
+            simulate_peg_map(state, &map, histogram);
+        } else {
+            simulate_peg_map_batched(state, &map, histogram);
+        }
+        double seconds = seconds_since(start);
+        printf("%-8s %6d rows: %8.3f s, %10.3e balls/s\n", names[engine],
+               state.number_of_rows, seconds, number_of_balls / seconds);
+        free(histogram);
+    }
+
+    destroy_peg_map(&map);
+}
+
+int main() {
+    const int64_t number_of_balls = 20000000;
+    int compartments[] = {11, 33, 65, 129, 1025};
+
+    printf("Best instruction set: %s\n\n",
+           instruction_set_name(best_instruction_set()));
+    for (int i = 0; i < 5; ++i) {
+        benchmark_instruction_sets(number_of_balls, compartments[i]);
+    }
+
+    printf("\nPeg maps:\n");
+    for (int i = 0; i < 3; ++i) {
+        benchmark_peg_maps(number_of_balls / 10, compartments[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,319 @@
+// Compiled and executed with mpicc -o galton_mpi_benchmark
+// galton_mpi_benchmark.c galton.c galton_simd.c galton_wavefront.c philox.c
+// binomial.c -Wall -O3 -fopenmp -lm && mpirun -np 8 galton_mpi_benchmark
+// [--balls 1000000,4000000] [--rows 16,64,256] [--engines 0,1,2]
+// [--threads 1,0] [--repetitions 3] [--output results.csv]
+// [--baseline old.csv [--max-slowdown 0.1]]
+#include "galton.h"
+
+#include <mpi.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Maximum number of values per dimension of the grid
+#define MAX_VALUES 16
+
+typedef struct Values {
+    long long value[MAX_VALUES];
+    int count;
+} Values;
+
+/**
+ * @brief The grid of the benchmark. The numbers of ranks are 1, 2, 4, ...
+ * up to the number of processes, plus the number of processes itself
+ */
+typedef struct BenchmarkOptions {
+    Values balls;
+    Values rows;
+    Values engines;
+    Values threads; // 0 = one thread per core
+    int repetitions;
+    const char *output_file;
+    const char *baseline_file;
+    // Runs slower than (1 - max_slowdown) times the baseline are regressions
+    double max_slowdown;
+} BenchmarkOptions;
+
+/**
+ * @brief One row of the results, also the format of the CSV output
+ */
+typedef struct Measurement {
+    int engine;
+    long long balls;
+    int rows;
+    int threads;
+    int ranks;
+    double seconds;        // Simulation, slowest rank, best repetition
+    double gather_seconds; // MPI_Reduce of the histograms
+} Measurement;
+
+static const char *CSV_HEADER = "engine,balls,rows,threads,ranks,seconds,"
+                                "balls_per_second,ns_per_peg,gather_seconds";
+
+int get_rank() {
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    return rank;
+}
+
+// Parses a comma separated list like 16,64,256
+Values parse_values(const char *list) {
+    Values values = {.count = 0};
+    char *end;
+    while (values.count < MAX_VALUES && *list != '\0') {
+        values.value[values.count++] = strtoll(list, &end, 10);
+        if (*end != ',') {
+            break;
+        }
+        list = end + 1;
+    }
+    return values;
+}
+
+BenchmarkOptions parse_benchmark_options(int argc, char **argv) {
+    BenchmarkOptions options = {.balls = parse_values("1000000,4000000"),
+                                .rows = parse_values("16,64,256"),
+                                .engines = parse_values("0,1,2"),
+                                .threads = parse_values("1,0"),
+                                .repetitions = 3,
+                                .output_file = NULL,
+                                .baseline_file = NULL,
+                                .max_slowdown = 0.1};
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--balls") == 0) {
+            options.balls = parse_values(argv[i + 1]);
+        } else if (strcmp(argv[i], "--rows") == 0) {
+            options.rows = parse_values(argv[i + 1]);
+        } else if (strcmp(argv[i], "--engines") == 0) {
+            options.engines = parse_values(argv[i + 1]);
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            options.threads = parse_values(argv[i + 1]);
+        } else if (strcmp(argv[i], "--repetitions") == 0) {
+            options.repetitions = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--output") == 0) {
+            options.output_file = argv[i + 1];
+        } else if (strcmp(argv[i], "--baseline") == 0) {
+            options.baseline_file = argv[i + 1];
+        } else if (strcmp(argv[i], "--max-slowdown") == 0) {
+            options.max_slowdown = atof(argv[i + 1]);
+        } else if (get_rank() == 0) {
+            printf("Ignoring unknown option %s\n", argv[i]);
+        }
+    }
+    if (options.repetitions < 1) {
+        options.repetitions = 1;
+    }
+    return options;
+}
+
+/**
+ * @brief Runs one configuration on the processes of communicator like the
+ * static mode of 4_1: Every process simulates its share of the balls, then the
+ * histograms are summed on rank 0 with MPI_Reduce, like
+ * gather_simulation_results does. Both parts are timed separately, each with
+ * the slowest process and the best of all repetitions
+ */
+Measurement measure(SimulationState state, MPI_Comm communicator,
+                    int repetitions) {
+    int rank, ranks;
+    MPI_Comm_rank(communicator, &rank);
+    MPI_Comm_size(communicator, &ranks);
+    Measurement measurement = {.engine = state.engine,
+                               .balls = state.number_of_balls,
+                               .rows = state.number_of_rows,
+                               .threads = state.number_of_threads,
+                               .ranks = ranks,
+                               .seconds = -1,
+                               .gather_seconds = -1};
+    int64_t *histogram = create_histogram(state);
+    int64_t *histogram_sum = create_histogram(state);
+
+    for (int repetition = 0; repetition < repetitions; ++repetition) {
+        memset(histogram, 0, state.number_of_compartments * sizeof(int64_t));
+        MPI_Barrier(communicator);
+        double start = MPI_Wtime();
+        simulate(split_balls(state, rank, ranks), histogram);
+        double times[2];
+        times[0] = MPI_Wtime() - start;
+
+        MPI_Barrier(communicator);
+        start = MPI_Wtime();
+        MPI_Reduce(histogram, histogram_sum, state.number_of_compartments,
+                   MPI_INT64_T, MPI_SUM, 0, communicator);
+        times[1] = MPI_Wtime() - start;
+
+        double slowest[2];
+        MPI_Allreduce(times, slowest, 2, MPI_DOUBLE, MPI_MAX, communicator);
+        if (measurement.seconds < 0 || slowest[0] < measurement.seconds) {
+            measurement.seconds = slowest[0];
+        }
+        if (measurement.gather_seconds < 0 ||
+            slowest[1] < measurement.gather_seconds) {
+            measurement.gather_seconds = slowest[1];
+        }
+    }
+
+    free(histogram_sum);
+    free(histogram);
+    return measurement;
+}
+
+double balls_per_second(Measurement measurement) {
+    return measurement.balls / measurement.seconds;
+}
+
+void write_measurement(FILE *file, Measurement measurement) {
+    fprintf(file, "%d,%lld,%d,%d,%d,%.6f,%.6g,%.6g,%.3g\n", measurement.engine,
+            measurement.balls, measurement.rows, measurement.threads,
+            measurement.ranks, measurement.seconds,
+            balls_per_second(measurement),
+            measurement.seconds * 1e9 / measurement.balls / measurement.rows,
+            measurement.gather_seconds);
+}
+
+/**
+ * @brief Reads the measurements of an earlier run from its CSV output
+ * @return The number of measurements, 0 if the file can't be read
+ */
+int read_baseline(const char *path, Measurement *baseline, int capacity) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Can't read the baseline %s\n", path);
+        return 0;
+    }
+
+    int count = 0;
+    char line[256];
+    while (count < capacity && fgets(line, sizeof(line), file) != NULL) {
+        Measurement m;
+        if (sscanf(line, "%d,%lld,%d,%d,%d,%lf", &m.engine, &m.balls, &m.rows,
+                   &m.threads, &m.ranks, &m.seconds) == 6) {
+            baseline[count++] = m;
+        }
+    }
+
+    fclose(file);
+    return count;
+}
+
+/**
+ * @brief Compares a measurement with the same configuration in the baseline
+ * @return true if it is slower than the baseline allows
+ */
+bool is_regression(Measurement measurement, const Measurement *baseline,
+                   int baseline_size, double max_slowdown) {
+    for (int i = 0; i < baseline_size; ++i) {
+        Measurement old = baseline[i];
+        if (old.engine != measurement.engine ||
+            old.balls != measurement.balls || old.rows != measurement.rows ||
+            old.threads != measurement.threads ||
+            old.ranks != measurement.ranks) {
+            continue;
+        }
+        double ratio = balls_per_second(measurement) / balls_per_second(old);
+        if (ratio < 1 - max_slowdown) {
+            fprintf(stderr,
+                    "REGRESSION engine %d, %lld balls, %d rows, %d threads, "
+                    "%d ranks: %.3g balls/s, %.0f%% of the baseline\n",
+                    measurement.engine, measurement.balls, measurement.rows,
+                    measurement.threads, measurement.ranks,
+                    balls_per_second(measurement), ratio * 100);
+            return true;
+        }
+        return false;
+    }
+    return false;
+}
+
+/**
+ * @brief Measures the galton board simulation over a grid of engines, balls,
+ * rows, threads and ranks and prints CSV (or writes it to --output). The
+ * ranks are varied with communicators of the first 1, 2, 4, ... processes, so
+ * one mpirun covers all of them. With --baseline, every configuration is
+ * compared with an earlier output and the exit code is 1 if one got slower by
+ * more than --max-slowdown
+ */
+int main(int argc, char **argv) {
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    int rank = get_rank();
+    int np;
+    MPI_Comm_size(MPI_COMM_WORLD, &np);
+    BenchmarkOptions options = parse_benchmark_options(argc, argv);
+
+    FILE *output = stdout;
+    if (rank == 0 && options.output_file != NULL) {
+        output = fopen(options.output_file, "w");
+        if (output == NULL) {
+            printf("Can't write %s, using stdout\n", options.output_file);
+            output = stdout;
+        }
+    }
+    Measurement *baseline = NULL;
+    int baseline_size = 0;
+    if (rank == 0 && options.baseline_file != NULL) {
+        baseline = (Measurement *)malloc(4096 * sizeof(Measurement));
+        baseline_size = read_baseline(options.baseline_file, baseline, 4096);
+    }
+    if (rank == 0) {
+        fprintf(output, "%s\n", CSV_HEADER);
+    }
+
+    int regressions = 0;
+    for (int ranks = 1;; ranks *= 2) {
+        if (ranks > np) {
+            ranks = np;
+        }
+        MPI_Comm communicator;
+        MPI_Comm_split(MPI_COMM_WORLD, rank < ranks ? 0 : MPI_UNDEFINED, rank,
+                       &communicator);
+        if (communicator == MPI_COMM_NULL) {
+            if (ranks == np) {
+                break;
+            }
+            continue;
+        }
+
+        for (int e = 0; e < options.engines.count; ++e) {
+            for (int b = 0; b < options.balls.count; ++b) {
+                for (int r = 0; r < options.rows.count; ++r) {
+                    for (int t = 0; t < options.threads.count; ++t) {
+                        SimulationState state = {
+                            .number_of_balls = options.balls.value[b],
+                            .number_of_compartments =
+                                (int)options.rows.value[r] + 1,
+                            .number_of_rows = (int)options.rows.value[r],
+                            .engine = (int)options.engines.value[e],
+                            .seed = 1,
+                            .first_ball = 0,
+                            .number_of_threads =
+                                (int)options.threads.value[t]};
+                        Measurement measurement = measure(
+                            state, communicator, options.repetitions);
+                        if (rank == 0) {
+                            write_measurement(output, measurement);
+                            fflush(output);
+                            regressions += is_regression(
+                                measurement, baseline, baseline_size,
+                                options.max_slowdown);
+                        }
+                    }
+                }
+            }
+        }
+        MPI_Comm_free(&communicator);
+        if (ranks == np) {
+            break;
+        }
+    }
+
+    if (output != stdout) {
+        fclose(output);
+    }
+    free(baseline);
+    MPI_Bcast(&regressions, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Finalize();
+    return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,159 @@
+#include "galton_pegs.h"
+#include "galton_simd.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+// Number of balls whose random words are generated together by the batched
+// engine
+#define BALLS_PER_BATCH 256
+
+static uint64_t probability_to_threshold(double probability) {
+    if (probability <= 0) {
+        return 0;
+    }
+    if (probability >= 1) {
+        return UINT64_C(1) << 32;
+    }
+    return (uint64_t)ldexp(probability, 32);
+}
+
+// In size_t, boards taller than 46340 rows have more than INT_MAX pegs
+static size_t first_peg_of_row(int row) {
+    return (size_t)row * ((size_t)row + 1) / 2;
+}
+
+/**
+ * @brief A board on which every peg sends the balls right with the same
+ * probability. Change single pegs with peg_map_set_probability
+ */
+PegMap create_peg_map(int number_of_rows, double probability) {
+    PegMap map = {.number_of_rows = number_of_rows};
+    size_t number_of_pegs = first_peg_of_row(number_of_rows);
+    map.thresholds = (uint64_t *)malloc(number_of_pegs * sizeof(uint64_t));
+    uint64_t threshold = probability_to_threshold(probability);
+    for (size_t i = 0; i < number_of_pegs; ++i) {
+        map.thresholds[i] = threshold;
+    }
+
+    return map;
+}
+
+void destroy_peg_map(PegMap *map) {
+    free(map->thresholds);
+    map->thresholds = NULL;
+}
+
+void peg_map_set_probability(PegMap *map, int row, int column,
+                             double probability) {
+    map->thresholds[first_peg_of_row(row) + column] =
+        probability_to_threshold(probability);
+}
+
+/**
+ * @brief The probability the simulation actually uses, i.e. the one given to
+ * the map rounded down to a multiple of 2^-32
+ */
+double peg_map_probability(const PegMap *map, int row, int column) {
+    return ldexp((double)map->thresholds[first_peg_of_row(row) + column], -32);
+}
+
+/**
+ * @brief The exact distribution of the compartments, computed row by row: The
+ * balls at peg c of a row go on to peg c + 1 with its probability and to peg c
+ * otherwise
+ * @return number_of_rows + 1 probabilities, to be freed by the caller
+ */
+double *peg_map_distribution(const PegMap *map) {
+    int rows = map->number_of_rows;
+    double *distribution = (double *)calloc(rows + 1, sizeof(double));
+    distribution[0] = 1;
+    for (int row = 0; row < rows; ++row) {
+        // Backwards, so every peg still has the value of the previous row
+        for (int column = row; column >= 0; --column) {
+            double right = distribution[column] *
+                           peg_map_probability(map, row, column);
+            distribution[column + 1] += right;
+            distribution[column] -= right;
+        }
+    }
+
+    return distribution;
+}
+
+/**
+ * @brief Every ball needs a whole random word per row instead of a bit, ball b
+ * uses the words b * number_of_rows, ... of its own stream. The histogram
+ * therefore doesn't depend on how the balls are split among processes or
+ * threads, but it differs from the fair engines in galton.c
+ */
+static RandomStream peg_map_stream(SimulationState state) {
+    return random_stream_create(state.seed, SHARED_STREAM, PEG_MAP_STREAM);
+}
+
+/**
+ * @brief Lets the balls of state fall one after another. Every row costs a
+ * random word, a compare and an add, without division or modulo
+ */
+void simulate_peg_map(SimulationState state, const PegMap *map,
+                      int64_t *histogram) {
+    RandomStream stream = peg_map_stream(state);
+    int rows = map->number_of_rows;
+
+    for (int64_t i = 0; i < state.number_of_balls; ++i) {
+        RandomCursor cursor = random_cursor_create(
+            stream, (uint64_t)(state.first_ball + i) * rows);
+        const uint64_t *row_thresholds = map->thresholds;
+        int column = 0;
+        for (int row = 0; row < rows; ++row) {
+            column += random_cursor_word(&cursor) < row_thresholds[column];
+            row_thresholds += row + 1;
+        }
+        ++histogram[column];
+    }
+}
+
+/**
+ * @brief Same histogram as simulate_peg_map. The random words of a batch of
+ * balls are generated at once with the vectorized generator of galton_simd.c,
+ * then the whole batch falls through the board one row at a time, so the
+ * thresholds of a row stay in the cache while all balls of the batch pass it
+ */
+void simulate_peg_map_batched(SimulationState state, const PegMap *map,
+                              int64_t *histogram) {
+    RandomStream stream = peg_map_stream(state);
+    InstructionSet isa = best_instruction_set();
+    int rows = map->number_of_rows;
+    uint32_t *buffer = (uint32_t *)malloc(
+        ((size_t)BALLS_PER_BATCH * rows + SIMD_STREAM_PADDING) *
+        sizeof(uint32_t));
+    int columns[BALLS_PER_BATCH];
+
+    for (int64_t done = 0; done < state.number_of_balls;
+         done += BALLS_PER_BATCH) {
+        int batch = BALLS_PER_BATCH;
+        if (state.number_of_balls - done < BALLS_PER_BATCH) {
+            batch = (int)(state.number_of_balls - done);
+        }
+        const uint32_t *words = simd_stream_words(
+            stream, isa, (uint64_t)(state.first_ball + done) * rows,
+            (size_t)batch * rows, buffer);
+
+        for (int i = 0; i < batch; ++i) {
+            columns[i] = 0;
+        }
+        const uint64_t *row_thresholds = map->thresholds;
+        for (int row = 0; row < rows; ++row) {
+            const uint32_t *row_words = words + row;
+            for (int i = 0; i < batch; ++i) {
+                columns[i] += row_words[i * rows] < row_thresholds[columns[i]];
+            }
+            row_thresholds += row + 1;
+        }
+        for (int i = 0; i < batch; ++i) {
+            ++histogram[columns[i]];
+        }
+    }
+
+    free(buffer);
+}
@@ -0,0 +1,37 @@
+// Boards with a probability of its own for every peg, e.g. to model biased or
+// defective boards
+#ifndef GALTON_PEGS_H_INCLUDED
+#define GALTON_PEGS_H_INCLUDED
+
+#include "galton.h"
+
+#include <stdint.h>
+
+// Counter word 3 of the stream of the peg map engines
+#define PEG_MAP_STREAM 0x5045474D
+
+/**
+ * @brief The pegs of a triangular board: Row r has the pegs 0, ..., r, and a
+ * ball that went right c times so far hits peg c. Instead of the probability,
+ * every peg stores the threshold its random word has to be below for the ball
+ * to go right, so the simulation needs one integer compare per peg
+ */
+typedef struct PegMap {
+    int number_of_rows;
+    // Peg c of row r at r * (r + 1) / 2 + c. Thresholds are p * 2^32, 64 bits
+    // wide so that p = 1 always goes right
+    uint64_t *thresholds;
+} PegMap;
+
+PegMap create_peg_map(int number_of_rows, double probability);
+void destroy_peg_map(PegMap *map);
+void peg_map_set_probability(PegMap *map, int row, int column,
+                             double probability);
+double peg_map_probability(const PegMap *map, int row, int column);
+double *peg_map_distribution(const PegMap *map);
+void simulate_peg_map(SimulationState state, const PegMap *map,
+                      int64_t *histogram);
+void simulate_peg_map_batched(SimulationState state, const PegMap *map,
+                              int64_t *histogram);
+
+#endif
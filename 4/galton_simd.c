@@ -0,0 +1,458 @@
+#include "galton_simd.h"
+#include "philox.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86_SIMD
+#endif
+
+// Number of balls per batch. The random words of a whole batch are generated
+// first, then the compartments are computed vector by vector
+#define BALLS_PER_BATCH 256
+
+// Number of balls per call of a kernel. Small enough for its int counters
+#define BALLS_PER_PASS (INT64_C(1) << 30)
+
+const char *instruction_set_name(InstructionSet isa) {
+    switch (isa) {
+    case ISA_SCALAR:
+        return "scalar";
+    case ISA_AVX2:
+        return "AVX2";
+    case ISA_AVX512:
+        return "AVX-512";
+    default:
+        return "unknown";
+    }
+}
+
+bool instruction_set_supported(InstructionSet isa) {
+    switch (isa) {
+    case ISA_SCALAR:
+        return true;
+#ifdef X86_SIMD
+    case ISA_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case ISA_AVX512:
+        return __builtin_cpu_supports("avx512f") &&
+               __builtin_cpu_supports("avx512bw");
+#endif
+    default:
+        return false;
+    }
+}
+
+InstructionSet best_instruction_set() {
+    for (int isa = NUMBER_OF_INSTRUCTION_SETS - 1; isa > ISA_SCALAR; --isa) {
+        if (instruction_set_supported(isa)) {
+            return isa;
+        }
+    }
+    return ISA_SCALAR;
+}
+
+/**
+ * Shared by both kernels: Which words of the ball stream a batch needs and
+ * where the first one lands in the generated buffer. Blocks are always
+ * generated from a block boundary on, so the first word is at offset
+ * first_word % 4
+ */
+typedef struct Batch {
+    int number_of_balls;
+    uint64_t first_block;
+    int number_of_blocks;
+    int offset;
+} Batch;
+
+static Batch batch_create(SimulationState state, int64_t done,
+                          int words_per_ball) {
+    Batch batch;
+    batch.number_of_balls = BALLS_PER_BATCH;
+    if (state.number_of_balls - done < BALLS_PER_BATCH) {
+        batch.number_of_balls = (int)(state.number_of_balls - done);
+    }
+    uint64_t first_word = (uint64_t)(state.first_ball + done) * words_per_ball;
+    uint64_t end_word = first_word + batch.number_of_balls * words_per_ball;
+    batch.first_block = first_word / 4;
+    batch.number_of_blocks = (int)((end_word + 3) / 4 - batch.first_block);
+    batch.offset = (int)(first_word % 4);
+    return batch;
+}
+
+// The lower and upper halves of the 64 bit block indices of lanes 0, ..., n-1
+static void block_counters(uint64_t first_block, int n, uint32_t *low,
+                           uint32_t *high) {
+    for (int i = 0; i < n; ++i) {
+        low[i] = (uint32_t)(first_block + i);
+        high[i] = (uint32_t)((first_block + i) >> 32);
+    }
+}
+
+// Adds the per-lane histograms (lane-interleaved, lanes entries per
+// compartment) to histogram
+static void merge_lane_histograms(const int *lane_histograms, int lanes,
+                                  int64_t *histogram, SimulationState state) {
+    for (int i = 0; i < state.number_of_compartments; ++i) {
+        for (int lane = 0; lane < lanes; ++lane) {
+            histogram[i] += lane_histograms[i * lanes + lane];
+        }
+    }
+}
+
+#ifdef X86_SIMD
+
+//=============================================================================
+// AVX2: 8 lanes of 32 bits
+//=============================================================================
+
+#define AVX2 __attribute__((target("avx2")))
+
+// Low and high 32 bits of the 32x32 bit products of all 8 lanes.
+// _mm256_mul_epu32 only multiplies the even lanes, so the odd ones are shifted
+// down first
+static inline AVX2 void mulhilo_avx2(__m256i a, __m256i b, __m256i *low,
+                                     __m256i *high) {
+    __m256i even = _mm256_mul_epu32(a, b);
+    __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b);
+    *low = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+    *high = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+// Philox4x32-10 for 8 consecutive blocks, identical to philox4x32_10
+static inline AVX2 void philox_avx2(__m256i x[4], uint32_t k0, uint32_t k1) {
+    const __m256i M0 = _mm256_set1_epi32((int)0xD2511F53);
+    const __m256i M1 = _mm256_set1_epi32((int)0xCD9E8D57);
+    for (int i = 0; i < 10; ++i) {
+        if (i > 0) {
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+        __m256i low0, high0, low1, high1;
+        mulhilo_avx2(x[0], M0, &low0, &high0);
+        mulhilo_avx2(x[2], M1, &low1, &high1);
+        __m256i y0 = _mm256_xor_si256(
+            _mm256_xor_si256(high1, x[1]), _mm256_set1_epi32((int)k0));
+        __m256i y2 = _mm256_xor_si256(
+            _mm256_xor_si256(high0, x[3]), _mm256_set1_epi32((int)k1));
+        x[0] = y0;
+        x[1] = low1;
+        x[2] = y2;
+        x[3] = low0;
+    }
+}
+
+// Generates the blocks of a batch and stores their words in stream order
+static AVX2 void generate_words_avx2(RandomStream stream, Batch batch,
+                                     uint32_t *words) {
+    uint32_t low[8], high[8];
+    for (int block = 0; block < batch.number_of_blocks; block += 8) {
+        block_counters(batch.first_block + block, 8, low, high);
+        __m256i x[4] = {_mm256_loadu_si256((__m256i *)low),
+                        _mm256_loadu_si256((__m256i *)high),
+                        _mm256_set1_epi32((int)stream.rank),
+                        _mm256_set1_epi32((int)stream.thread)};
+        philox_avx2(x, stream.key.k[0], stream.key.k[1]);
+
+        // x[j] holds word j of 8 blocks, transpose to 8 blocks of 4 words
+        __m256i t0 = _mm256_unpacklo_epi32(x[0], x[1]);
+        __m256i t1 = _mm256_unpackhi_epi32(x[0], x[1]);
+        __m256i t2 = _mm256_unpacklo_epi32(x[2], x[3]);
+        __m256i t3 = _mm256_unpackhi_epi32(x[2], x[3]);
+        __m256i u0 = _mm256_unpacklo_epi64(t0, t2); // Blocks 0 and 4
+        __m256i u1 = _mm256_unpackhi_epi64(t0, t2); // Blocks 1 and 5
+        __m256i u2 = _mm256_unpacklo_epi64(t1, t3); // Blocks 2 and 6
+        __m256i u3 = _mm256_unpackhi_epi64(t1, t3); // Blocks 3 and 7
+        __m256i *out = (__m256i *)(words + 4 * block);
+        _mm256_storeu_si256(out, _mm256_permute2x128_si256(u0, u1, 0x20));
+        _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(u2, u3, 0x20));
+        _mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(u0, u1, 0x31));
+        _mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(u2, u3, 0x31));
+    }
+}
+
+// Number of set bits in every 32 bit lane (nibble lookup table)
+static inline AVX2 __m256i popcount_avx2(__m256i v) {
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3,
+                                           2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3,
+                                           1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i low = _mm256_and_si256(v, nibble);
+    __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+    __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(table, low),
+                                    _mm256_shuffle_epi8(table, high));
+    __m256i shorts = _mm256_maddubs_epi16(bytes, _mm256_set1_epi8(1));
+    return _mm256_madd_epi16(shorts, _mm256_set1_epi16(1));
+}
+
+static AVX2 void simulate_avx2(SimulationState state, int64_t *histogram) {
+    RandomStream stream = ball_stream(state);
+    int words_per_ball = random_words_per_ball(state.number_of_rows);
+    int last_rows = state.number_of_rows - 32 * (words_per_ball - 1);
+    const __m256i last_mask = _mm256_set1_epi32(
+        last_rows == 32 ? -1 : (int)((UINT32_C(1) << last_rows) - 1));
+    const __m256i lane_numbers = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    // Generated blocks are rounded up to multiples of 8, plus the offset
+    uint32_t *words = (uint32_t *)malloc(
+        (BALLS_PER_BATCH * words_per_ball + 4 + 32) * sizeof(uint32_t));
+    // The extra compartment collects the lanes past the end of a batch
+    int *lane_histograms =
+        (int *)calloc((state.number_of_compartments + 1) * 8, sizeof(int));
+    const __m256i unused = _mm256_set1_epi32(state.number_of_compartments);
+
+    for (int done = 0; done < state.number_of_balls; done += BALLS_PER_BATCH) {
+        Batch batch = batch_create(state, done, words_per_ball);
+        generate_words_avx2(stream, batch, words);
+        const uint32_t *first = words + batch.offset;
+
+        for (int ball = 0; ball < batch.number_of_balls; ball += 8) {
+            __m256i balls =
+                _mm256_add_epi32(_mm256_set1_epi32(ball), lane_numbers);
+            __m256i valid = _mm256_cmpgt_epi32(
+                _mm256_set1_epi32(batch.number_of_balls), balls);
+            __m256i index = _mm256_mullo_epi32(
+                balls, _mm256_set1_epi32(words_per_ball));
+            __m256i slots = _mm256_setzero_si256();
+            for (int k = 0; k < words_per_ball; ++k) {
+                __m256i word = _mm256_mask_i32gather_epi32(
+                    _mm256_setzero_si256(), (const int *)first, index, valid,
+                    4);
+                if (k == words_per_ball - 1) {
+                    word = _mm256_and_si256(word, last_mask);
+                }
+                slots = _mm256_add_epi32(slots, popcount_avx2(word));
+                index = _mm256_add_epi32(index, _mm256_set1_epi32(1));
+            }
+            slots = _mm256_blendv_epi8(unused, slots, valid);
+
+            // AVX2 has no scatter. Every lane has its own histogram, so the
+            // increments never collide
+            int lane_slots[8];
+            _mm256_storeu_si256((__m256i *)lane_slots, slots);
+            for (int lane = 0; lane < 8; ++lane) {
+                ++lane_histograms[lane_slots[lane] * 8 + lane];
+            }
+        }
+    }
+
+    merge_lane_histograms(lane_histograms, 8, histogram, state);
+    free(lane_histograms);
+    free(words);
+}
+
+//=============================================================================
+// AVX-512: 16 lanes of 32 bits
+//=============================================================================
+
+#define AVX512 __attribute__((target("avx512f,avx512bw")))
+
+static inline AVX512 void mulhilo_avx512(__m512i a, __m512i b, __m512i *low,
+                                         __m512i *high) {
+    __m512i even = _mm512_mul_epu32(a, b);
+    __m512i odd = _mm512_mul_epu32(_mm512_srli_epi64(a, 32), b);
+    *low = _mm512_mask_blend_epi32(0xAAAA, even, _mm512_slli_epi64(odd, 32));
+    *high = _mm512_mask_blend_epi32(0xAAAA, _mm512_srli_epi64(even, 32), odd);
+}
+
+static inline AVX512 void philox_avx512(__m512i x[4], uint32_t k0,
+                                        uint32_t k1) {
+    const __m512i M0 = _mm512_set1_epi32((int)0xD2511F53);
+    const __m512i M1 = _mm512_set1_epi32((int)0xCD9E8D57);
+    for (int i = 0; i < 10; ++i) {
+        if (i > 0) {
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+        __m512i low0, high0, low1, high1;
+        mulhilo_avx512(x[0], M0, &low0, &high0);
+        mulhilo_avx512(x[2], M1, &low1, &high1);
+        __m512i y0 = _mm512_xor_si512(_mm512_xor_si512(high1, x[1]),
+                                      _mm512_set1_epi32((int)k0));
+        __m512i y2 = _mm512_xor_si512(_mm512_xor_si512(high0, x[3]),
+                                      _mm512_set1_epi32((int)k1));
+        x[0] = y0;
+        x[1] = low1;
+        x[2] = y2;
+        x[3] = low0;
+    }
+}
+
+static AVX512 void generate_words_avx512(RandomStream stream, Batch batch,
+                                         uint32_t *words) {
+    uint32_t low[16], high[16];
+    for (int block = 0; block < batch.number_of_blocks; block += 16) {
+        block_counters(batch.first_block + block, 16, low, high);
+        __m512i x[4] = {_mm512_loadu_si512(low), _mm512_loadu_si512(high),
+                        _mm512_set1_epi32((int)stream.rank),
+                        _mm512_set1_epi32((int)stream.thread)};
+        philox_avx512(x, stream.key.k[0], stream.key.k[1]);
+
+        // Transpose within the 128 bit lanes like in the AVX2 version, which
+        // gives u0 = blocks 0, 4, 8, 12 and so on. Then reorder the 128 bit
+        // lanes
+        __m512i t0 = _mm512_unpacklo_epi32(x[0], x[1]);
+        __m512i t1 = _mm512_unpackhi_epi32(x[0], x[1]);
+        __m512i t2 = _mm512_unpacklo_epi32(x[2], x[3]);
+        __m512i t3 = _mm512_unpackhi_epi32(x[2], x[3]);
+        __m512i u0 = _mm512_unpacklo_epi64(t0, t2);
+        __m512i u1 = _mm512_unpackhi_epi64(t0, t2);
+        __m512i u2 = _mm512_unpacklo_epi64(t1, t3);
+        __m512i u3 = _mm512_unpackhi_epi64(t1, t3);
+        __m512i v0 = _mm512_shuffle_i32x4(u0, u1, 0x44); // 0 4 1 5
+        __m512i v1 = _mm512_shuffle_i32x4(u0, u1, 0xEE); // 8 12 9 13
+        __m512i v2 = _mm512_shuffle_i32x4(u2, u3, 0x44); // 2 6 3 7
+        __m512i v3 = _mm512_shuffle_i32x4(u2, u3, 0xEE); // 10 14 11 15
+        uint32_t *out = words + 4 * block;
+        _mm512_storeu_si512(out, _mm512_shuffle_i32x4(v0, v2, 0x88));
+        _mm512_storeu_si512(out + 16, _mm512_shuffle_i32x4(v0, v2, 0xDD));
+        _mm512_storeu_si512(out + 32, _mm512_shuffle_i32x4(v1, v3, 0x88));
+        _mm512_storeu_si512(out + 48, _mm512_shuffle_i32x4(v1, v3, 0xDD));
+    }
+}
+
+// VPOPCNTD needs AVX512_VPOPCNTDQ, the lookup table works on every AVX-512 CPU
+static inline AVX512 __m512i popcount_avx512(__m512i v) {
+    const __m512i table = _mm512_broadcast_i32x4(
+        _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+    const __m512i nibble = _mm512_set1_epi8(0x0F);
+    __m512i low = _mm512_and_si512(v, nibble);
+    __m512i high = _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble);
+    __m512i bytes = _mm512_add_epi8(_mm512_shuffle_epi8(table, low),
+                                    _mm512_shuffle_epi8(table, high));
+    __m512i shorts = _mm512_maddubs_epi16(bytes, _mm512_set1_epi8(1));
+    return _mm512_madd_epi16(shorts, _mm512_set1_epi16(1));
+}
+
+static AVX512 void simulate_avx512(SimulationState state,
+                                   int64_t *histogram) {
+    RandomStream stream = ball_stream(state);
+    int words_per_ball = random_words_per_ball(state.number_of_rows);
+    int last_rows = state.number_of_rows - 32 * (words_per_ball - 1);
+    const __m512i last_mask = _mm512_set1_epi32(
+        last_rows == 32 ? -1 : (int)((UINT32_C(1) << last_rows) - 1));
+    const __m512i lane_numbers = _mm512_setr_epi32(
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+    uint32_t *words = (uint32_t *)malloc(
+        (BALLS_PER_BATCH * words_per_ball + 4 + 64) * sizeof(uint32_t));
+    int *lane_histograms =
+        (int *)calloc(state.number_of_compartments * 16, sizeof(int));
+
+    for (int done = 0; done < state.number_of_balls; done += BALLS_PER_BATCH) {
+        Batch batch = batch_create(state, done, words_per_ball);
+        generate_words_avx512(stream, batch, words);
+        const uint32_t *first = words + batch.offset;
+
+        for (int ball = 0; ball < batch.number_of_balls; ball += 16) {
+            __m512i balls =
+                _mm512_add_epi32(_mm512_set1_epi32(ball), lane_numbers);
+            __mmask16 valid = _mm512_cmplt_epi32_mask(
+                balls, _mm512_set1_epi32(batch.number_of_balls));
+            __m512i index = _mm512_mullo_epi32(
+                balls, _mm512_set1_epi32(words_per_ball));
+            __m512i slots = _mm512_setzero_si512();
+            for (int k = 0; k < words_per_ball; ++k) {
+                __m512i word = _mm512_mask_i32gather_epi32(
+                    _mm512_setzero_si512(), valid, index, first, 4);
+                if (k == words_per_ball - 1) {
+                    word = _mm512_and_si512(word, last_mask);
+                }
+                slots = _mm512_add_epi32(slots, popcount_avx512(word));
+                index = _mm512_add_epi32(index, _mm512_set1_epi32(1));
+            }
+
+            // Every lane owns its histogram, so gather, add and scatter never
+            // touch the same address twice
+            __m512i position = _mm512_add_epi32(
+                _mm512_mullo_epi32(slots, _mm512_set1_epi32(16)),
+                lane_numbers);
+            __m512i counts = _mm512_mask_i32gather_epi32(
+                _mm512_setzero_si512(), valid, position, lane_histograms, 4);
+            counts = _mm512_add_epi32(counts, _mm512_set1_epi32(1));
+            _mm512_mask_i32scatter_epi32(lane_histograms, valid, position,
+                                         counts, 4);
+        }
+    }
+
+    merge_lane_histograms(lane_histograms, 16, histogram, state);
+    free(lane_histograms);
+    free(words);
+}
+
+#endif
+
+/**
+ * @brief Adds the same balls to the histogram as simulate_bit_parallel, using
+ * the given instruction set. Falls back to the scalar engine if the CPU doesn't
+ * support it
+ */
+void simulate_simd(SimulationState state, InstructionSet isa,
+                   int64_t *histogram) {
+    if (!instruction_set_supported(isa) || isa == ISA_SCALAR) {
+        simulate_bit_parallel(state, histogram);
+        return;
+    }
+
+#ifdef X86_SIMD
+    // The lane histograms count in 32 bits. Passes of at most
+    // BALLS_PER_PASS balls can't overflow them
+    for (int64_t done = 0; done < state.number_of_balls;
+         done += BALLS_PER_PASS) {
+        SimulationState pass = state;
+        pass.first_ball += done;
+        if (pass.number_of_balls - done < BALLS_PER_PASS) {
+            pass.number_of_balls -= done;
+        } else {
+            pass.number_of_balls = BALLS_PER_PASS;
+        }
+
+        if (isa == ISA_AVX512) {
+            simulate_avx512(pass, histogram);
+        } else {
+            simulate_avx2(pass, histogram);
+        }
+    }
+#endif
+}
+
+/**
+ * @brief The words first_index, ..., first_index + count - 1 of a stream, like
+ * random_stream_fill but generated with the given instruction set. For other
+ * engines that need many random words
+ * @param buffer Room for count + SIMD_STREAM_PADDING words. The generators
+ * start at a block boundary and write whole vectors of blocks
+ * @return Where word first_index is in buffer
+ */
+const uint32_t *simd_stream_words(RandomStream stream, InstructionSet isa,
+                                  uint64_t first_index, size_t count,
+                                  uint32_t *buffer) {
+    if (!instruction_set_supported(isa) || isa == ISA_SCALAR) {
+        random_stream_fill(stream, first_index, buffer, count);
+        return buffer;
+    }
+
+    Batch batch;
+    batch.first_block = first_index / 4;
+    batch.number_of_blocks =
+        (int)((first_index + count + 3) / 4 - batch.first_block);
+    batch.offset = (int)(first_index % 4);
+#ifdef X86_SIMD
+    if (isa == ISA_AVX512) {
+        generate_words_avx512(stream, batch, buffer);
+    } else {
+        generate_words_avx2(stream, batch, buffer);
+    }
+#endif
+    return buffer + batch.offset;
+}
+
+int64_t *run_simulation_simd(SimulationState state, InstructionSet isa) {
+    int64_t *histogram = create_histogram(state);
+    simulate_simd(state, isa, histogram);
+
+    return histogram;
+}
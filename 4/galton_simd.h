@@ -0,0 +1,32 @@
+// Vectorized version of the bit-parallel engine. The random words are
+// generated in vector registers and the compartments of 8 (AVX2) or 16
+// (AVX-512) balls are computed with one instruction sequence
+#ifndef GALTON_SIMD_H_INCLUDED
+#define GALTON_SIMD_H_INCLUDED
+
+#include "galton.h"
+
+#include <stdbool.h>
+
+typedef enum InstructionSet {
+    ISA_SCALAR,
+    ISA_AVX2,
+    ISA_AVX512,
+    NUMBER_OF_INSTRUCTION_SETS
+} InstructionSet;
+
+const char *instruction_set_name(InstructionSet isa);
+bool instruction_set_supported(InstructionSet isa);
+InstructionSet best_instruction_set();
+void simulate_simd(SimulationState state, InstructionSet isa,
+                   int64_t *histogram);
+int64_t *run_simulation_simd(SimulationState state, InstructionSet isa);
+
+// Room the buffer of simd_stream_words needs beyond the requested words
+#define SIMD_STREAM_PADDING (4 + 64)
+
+const uint32_t *simd_stream_words(RandomStream stream, InstructionSet isa,
+                                  uint64_t first_index, size_t count,
+                                  uint32_t *buffer);
+
+#endif
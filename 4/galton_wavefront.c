@@ -0,0 +1,176 @@
+#include "galton_wavefront.h"
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef _OPENMP
+#define CACHE_LINE_SIZE 64
+
+// Must be a power of 2
+#define QUEUE_CAPACITY 1024
+
+/**
+ * Lock-free single-producer/single-consumer queue between two neighboring
+ * bands. Only the producer writes tail and only the consumer writes head, so
+ * an acquire/release pair per operation is all the synchronization needed.
+ * Both indices live on their own cache line to avoid false sharing
+ */
+typedef struct BallQueue {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+    _Alignas(CACHE_LINE_SIZE) atomic_bool producer_finished;
+    _Alignas(CACHE_LINE_SIZE) BoardEntry entries[QUEUE_CAPACITY];
+} BallQueue;
+
+static bool queue_push(BallQueue *queue, BoardEntry entry) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    if (tail - head == QUEUE_CAPACITY) {
+        return false;
+    }
+    queue->entries[tail % QUEUE_CAPACITY] = entry;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static bool queue_pop(BallQueue *queue, BoardEntry *entry) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head == tail) {
+        return false;
+    }
+    *entry = queue->entries[head % QUEUE_CAPACITY];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return true;
+}
+
+static void queue_init(BallQueue *queue) {
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->producer_finished, false);
+}
+
+/**
+ * @brief Runs the pipeline of one band. Band 0 inserts the balls, the others
+ * take them from the queue of the band above. A ball leaving the band goes to
+ * the queue of the band below, or into the histogram for the last band. The
+ * band is done once no ball is left in it and the band above is done
+ */
+static void run_band(SimulationState state, Board *band, BallQueue *input,
+                     BallQueue *output, int64_t *histogram) {
+    RandomStream stream = ball_stream(state);
+    int64_t next_ball = 0;
+    int in_flight = 0;
+
+    for (;;) {
+        BoardEntry incoming = {.ball = EMPTY};
+        bool input_finished;
+        if (input == NULL) {
+            if (next_ball < state.number_of_balls) {
+                incoming.ball = state.first_ball + next_ball++;
+                incoming.column = 0;
+            }
+            input_finished = next_ball == state.number_of_balls;
+        } else {
+            // Read the flag first: If it is set, every ball has been pushed
+            input_finished = atomic_load_explicit(&input->producer_finished,
+                                                  memory_order_acquire);
+            if (queue_pop(input, &incoming)) {
+                input_finished = false;
+            }
+        }
+
+        if (incoming.ball == EMPTY && in_flight == 0) {
+            if (input_finished) {
+                break;
+            }
+            // Nothing to do until the band above delivers
+            sched_yield();
+            continue;
+        }
+        if (incoming.ball != EMPTY) {
+            ++in_flight;
+        }
+
+        BoardEntry outgoing = board_step(band, incoming, stream, state);
+        if (outgoing.ball == EMPTY) {
+            continue;
+        }
+        --in_flight;
+        if (output == NULL) {
+            ++histogram[outgoing.column];
+        } else {
+            while (!queue_push(output, outgoing)) {
+                sched_yield();
+            }
+        }
+    }
+
+    if (output != NULL) {
+        atomic_store_explicit(&output->producer_finished, true,
+                              memory_order_release);
+    }
+}
+#endif
+
+/**
+ * @brief Same histogram as simulate_board. Thread t owns the t-th band of
+ * consecutive rows, so every ball still falls through the board row by row and
+ * every band works on a different part of the wavefront at the same time. The
+ * balls are handed to the next band through lock-free queues
+ */
+void simulate_wavefront(SimulationState state, int number_of_threads,
+                        int64_t *histogram) {
+#ifdef _OPENMP
+    if (number_of_threads > state.number_of_rows) {
+        number_of_threads = state.number_of_rows;
+    }
+    if (number_of_threads <= 1) {
+        simulate_board(state, histogram);
+        return;
+    }
+
+    BallQueue *queues = NULL;
+#pragma omp parallel num_threads(number_of_threads)
+    {
+        // OpenMP may start fewer threads than requested, so the bands are
+        // made from the actual team
+        int bands = omp_get_num_threads();
+        int band_number = omp_get_thread_num();
+
+#pragma omp single
+        {
+            queues = (BallQueue *)aligned_alloc(CACHE_LINE_SIZE,
+                                                bands * sizeof(BallQueue));
+            for (int i = 0; i < bands; ++i) {
+                queue_init(&queues[i]);
+            }
+        }
+
+        // Split the rows like split_balls splits the balls
+        int share = state.number_of_rows / bands;
+        int remainder = state.number_of_rows % bands;
+        int first_row = band_number * share +
+                        (band_number < remainder ? band_number : remainder);
+        Board band = create_board(first_row,
+                                  share + (band_number < remainder ? 1 : 0));
+
+        BallQueue *input = band_number > 0 ? &queues[band_number - 1] : NULL;
+        BallQueue *output =
+            band_number < bands - 1 ? &queues[band_number] : NULL;
+        run_band(state, &band, input, output, histogram);
+
+        destroy_board(&band);
+    }
+    free(queues);
+#else
+    (void)number_of_threads;
+    simulate_board(state, histogram);
+#endif
+}
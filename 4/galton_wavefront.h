@@ -0,0 +1,11 @@
+// Pipeline-parallel version of the board engine. The rows of the board are
+// split into bands and every thread lets the balls fall through its band
+#ifndef GALTON_WAVEFRONT_H_INCLUDED
+#define GALTON_WAVEFRONT_H_INCLUDED
+
+#include "galton.h"
+
+void simulate_wavefront(SimulationState state, int number_of_threads,
+                        int64_t *histogram);
+
+#endif
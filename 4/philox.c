@@ -0,0 +1,111 @@
+#include "philox.h"
+
+#include <string.h>
+
+// Multipliers and Weyl constants from the Random123 reference implementation
+static const uint32_t PHILOX_M0 = 0xD2511F53;
+static const uint32_t PHILOX_M1 = 0xCD9E8D57;
+static const uint32_t PHILOX_W0 = 0x9E3779B9;
+static const uint32_t PHILOX_W1 = 0xBB67AE85;
+
+static inline PhiloxBlock philox_round(PhiloxBlock x, PhiloxKey key) {
+    uint64_t product0 = (uint64_t)PHILOX_M0 * x.v[0];
+    uint64_t product1 = (uint64_t)PHILOX_M1 * x.v[2];
+
+    PhiloxBlock result = {{(uint32_t)(product1 >> 32) ^ x.v[1] ^ key.k[0],
+                           (uint32_t)product1,
+                           (uint32_t)(product0 >> 32) ^ x.v[3] ^ key.k[1],
+                           (uint32_t)product0}};
+    return result;
+}
+
+PhiloxBlock philox4x32_10(PhiloxBlock counter, PhiloxKey key) {
+    for (int i = 0; i < 10; ++i) {
+        if (i > 0) {
+            key.k[0] += PHILOX_W0;
+            key.k[1] += PHILOX_W1;
+        }
+        counter = philox_round(counter, key);
+    }
+
+    return counter;
+}
+
+RandomStream random_stream_create(uint64_t seed, uint32_t rank,
+                                  uint32_t thread) {
+    RandomStream stream = {.key = {{(uint32_t)seed, (uint32_t)(seed >> 32)}},
+                           .rank = rank,
+                           .thread = thread};
+    return stream;
+}
+
+static inline PhiloxBlock random_stream_block(RandomStream stream,
+                                              uint64_t block_index) {
+    PhiloxBlock counter = {{(uint32_t)block_index,
+                            (uint32_t)(block_index >> 32), stream.rank,
+                            stream.thread}};
+    return philox4x32_10(counter, stream.key);
+}
+
+/**
+ * @brief Returns the random word with the given index. Every block of the
+ * generator holds 4 words, so 4 consecutive indices share one block
+ */
+uint32_t random_stream_word(RandomStream stream, uint64_t index) {
+    return random_stream_block(stream, index / 4).v[index % 4];
+}
+
+/**
+ * @brief Writes count consecutive words starting at first_index into words.
+ * Equivalent to calling random_stream_word for every index, but every block is
+ * only computed once
+ */
+void random_stream_fill(RandomStream stream, uint64_t first_index,
+                        uint32_t *words, size_t count) {
+    uint64_t index = first_index;
+    uint64_t end = first_index + count;
+
+    // Leading words of a partially used block
+    if (index % 4 != 0 && index < end) {
+        PhiloxBlock block = random_stream_block(stream, index / 4);
+        for (; index % 4 != 0 && index < end; ++index) {
+            *words++ = block.v[index % 4];
+        }
+    }
+
+    for (; index + 4 <= end; index += 4) {
+        PhiloxBlock block = random_stream_block(stream, index / 4);
+        memcpy(words, block.v, sizeof(block.v));
+        words += 4;
+    }
+
+    if (index < end) {
+        PhiloxBlock block = random_stream_block(stream, index / 4);
+        for (int i = 0; index < end; ++index, ++i) {
+            *words++ = block.v[i];
+        }
+    }
+}
+
+RandomCursor random_cursor_create(RandomStream stream, uint64_t first_index) {
+    RandomCursor cursor = {.stream = stream, .index = first_index};
+    cursor.block = random_stream_block(stream, first_index / 4);
+    return cursor;
+}
+
+uint32_t random_cursor_word(RandomCursor *cursor) {
+    if (cursor->index % 4 == 0) {
+        cursor->block = random_stream_block(cursor->stream, cursor->index / 4);
+    }
+    return cursor->block.v[cursor->index++ % 4];
+}
+
+/**
+ * @brief Uniformly distributed double in [0, 1) with all 53 bits of the
+ * mantissa random, made from two words
+ */
+double random_cursor_uniform(RandomCursor *cursor) {
+    uint32_t high = random_cursor_word(cursor) >> 5; // 27 bits
+    uint32_t low = random_cursor_word(cursor) >> 6;  // 26 bits
+    return (high * 67108864.0 + low) * (1.0 / 9007199254740992.0);
+}
@@ -0,0 +1,56 @@
+// Counter-based random number generator (Philox4x32-10, Salmon et al.,
+// "Parallel Random Numbers: As Easy as 1, 2, 3"). Unlike rand(), there is no
+// hidden state: The n-th random word of a stream is computed directly from
+// (seed, stream, n), so every process and thread can draw its numbers without
+// sharing anything and the results don't depend on how the work is split.
+#ifndef PHILOX_H_INCLUDED
+#define PHILOX_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 128 bits of counter or output
+typedef struct PhiloxBlock {
+    uint32_t v[4];
+} PhiloxBlock;
+
+typedef struct PhiloxKey {
+    uint32_t k[2];
+} PhiloxKey;
+
+// Used for rank and thread if a stream is shared by all workers
+#define SHARED_STREAM UINT32_MAX
+
+/**
+ * A stream is identified by the key (the seed) and the upper two counter words
+ * (rank and thread). The lower two counter words are the block index.
+ */
+typedef struct RandomStream {
+    PhiloxKey key;
+    uint32_t rank;
+    uint32_t thread;
+} RandomStream;
+
+/**
+ * Reads the words of a stream one after another, for consumers that don't know
+ * in advance how many random numbers they need (e.g. rejection samplers)
+ */
+typedef struct RandomCursor {
+    RandomStream stream;
+    uint64_t index; // Index of the next word
+    PhiloxBlock block; // The block containing the next word
+} RandomCursor;
+
+PhiloxBlock philox4x32_10(PhiloxBlock counter, PhiloxKey key);
+
+RandomStream random_stream_create(uint64_t seed, uint32_t rank,
+                                  uint32_t thread);
+uint32_t random_stream_word(RandomStream stream, uint64_t index);
+void random_stream_fill(RandomStream stream, uint64_t first_index,
+                        uint32_t *words, size_t count);
+
+RandomCursor random_cursor_create(RandomStream stream, uint64_t first_index);
+uint32_t random_cursor_word(RandomCursor *cursor);
+double random_cursor_uniform(RandomCursor *cursor);
+
+#endif
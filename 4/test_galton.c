@@ -0,0 +1,409 @@
+// Compiled and executed with gcc -o test_galton test_galton.c galton.c
+// galton_simd.c galton_wavefront.c galton_pegs.c philox.c binomial.c -Wall -O3
+// -fopenmp -lm && ./test_galton
+#include "binomial.h"
+#include "galton.h"
+#include "galton_pegs.h"
+#include "galton_simd.h"
+#include "philox.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+SimulationState create_state(int64_t number_of_balls, int number_of_compartments,
+                             SimulationEngine engine) {
+    SimulationState state = {.number_of_balls = number_of_balls,
+                             .number_of_compartments = number_of_compartments,
+                             .number_of_rows = number_of_compartments - 1,
+                             .engine = engine,
+                             .seed = 42,
+                             .first_ball = 0,
+                             .number_of_threads = 1};
+    return state;
+}
+
+bool histograms_equal(int64_t *a, int64_t *b, int size) {
+    return memcmp(a, b, size * sizeof(int64_t)) == 0;
+}
+
+int64_t histogram_sum(int64_t *histogram, int size) {
+    int64_t sum = 0;
+    for (int i = 0; i < size; ++i) {
+        sum += histogram[i];
+    }
+    return sum;
+}
+
+// Fails with probability ~1e-9 for a correct sampler. The seeds are fixed, so
+// the tests are deterministic anyway
+bool chi_square_acceptable(double chi_square, int degrees_of_freedom) {
+    return chi_square < degrees_of_freedom + 6 * sqrt(2.0 * degrees_of_freedom);
+}
+
+// Known answer tests from the Random123 distribution (kat_vectors)
+void test_philox_known_answers() {
+    PhiloxBlock zero = {{0, 0, 0, 0}};
+    PhiloxKey zero_key = {{0, 0}};
+    PhiloxBlock result = philox4x32_10(zero, zero_key);
+    assert(result.v[0] == 0x6627e8d5 && result.v[1] == 0xe169c58d &&
+           result.v[2] == 0xbc57ac4c && result.v[3] == 0x9b00dbd8);
+
+    PhiloxBlock pi = {{0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344}};
+    PhiloxKey pi_key = {{0xa4093822, 0x299f31d0}};
+    result = philox4x32_10(pi, pi_key);
+    assert(result.v[0] == 0xd16cfe09 && result.v[1] == 0x94fdcceb &&
+           result.v[2] == 0x5001e420 && result.v[3] == 0x24126ea1);
+}
+
+void test_random_stream_fill() {
+    RandomStream stream = random_stream_create(7, 3, 1);
+    uint32_t words[23];
+    random_stream_fill(stream, 5, words, 23);
+    for (int i = 0; i < 23; ++i) {
+        assert(words[i] == random_stream_word(stream, 5 + i));
+    }
+
+    // Different ranks and threads get different streams
+    RandomStream other = random_stream_create(7, 3, 2);
+    assert(random_stream_word(stream, 0) != random_stream_word(other, 0));
+}
+
+// The board and the bit-parallel engine read the same bits for every ball
+void test_engines_agree() {
+    int compartments[] = {2, 10, 33, 70};
+    for (int i = 0; i < 4; ++i) {
+        SimulationState state =
+            create_state(1000, compartments[i], ENGINE_BOARD);
+        int64_t *board = run_simulation(state);
+        state.engine = ENGINE_BIT_PARALLEL;
+        int64_t *bit_parallel = run_simulation(state);
+
+        assert(histogram_sum(board, compartments[i]) == 1000);
+        assert(histograms_equal(board, bit_parallel, compartments[i]));
+        free(board);
+        free(bit_parallel);
+    }
+}
+
+// Splitting the balls among workers doesn't change the summed histogram
+void test_split_is_reproducible() {
+    SimulationState state = create_state(10007, 21, ENGINE_BIT_PARALLEL);
+    int64_t *expected = run_simulation(state);
+
+    int64_t sum[21] = {0};
+    int splits[] = {0, 1, 999, 5000, 10007};
+    for (int i = 0; i < 4; ++i) {
+        SimulationState part = state;
+        part.first_ball = splits[i];
+        part.number_of_balls = splits[i + 1] - splits[i];
+        int64_t *histogram = run_simulation(part);
+        for (int j = 0; j < 21; ++j) {
+            sum[j] += histogram[j];
+        }
+        free(histogram);
+    }
+    assert(histograms_equal(expected, sum, 21));
+
+    state.seed = 43;
+    int64_t *other_seed = run_simulation(state);
+    assert(!histograms_equal(expected, other_seed, 21));
+
+    free(expected);
+    free(other_seed);
+}
+
+// Every instruction set has to reproduce the scalar histogram, including
+// batches that don't fill a vector and balls that start inside a block
+void test_simd_matches_scalar() {
+    int compartments[] = {2, 17, 32, 33, 34, 65, 100, 300};
+    for (int i = 0; i < 8; ++i) {
+        SimulationState state =
+            create_state(1000 + i, compartments[i], ENGINE_BIT_PARALLEL);
+        state.first_ball = 3 * i + 1;
+        int64_t *expected = run_simulation(state);
+
+        for (int isa = 0; isa < NUMBER_OF_INSTRUCTION_SETS; ++isa) {
+            int64_t *histogram = run_simulation_simd(state, isa);
+            assert(histograms_equal(expected, histogram, compartments[i]));
+            free(histogram);
+        }
+        free(expected);
+    }
+}
+
+// The threads split the balls like processes do, so the merged histogram has to
+// be the single threaded one
+void test_threads_match_single_thread() {
+    SimulationEngine engines[] = {ENGINE_BOARD, ENGINE_BIT_PARALLEL,
+                                  ENGINE_SIMD};
+    for (int i = 0; i < 3; ++i) {
+        SimulationState state = create_state(5003, 40, engines[i]);
+        int64_t *expected = run_simulation(state);
+
+        int threads[] = {2, 3, 8, 0};
+        for (int j = 0; j < 4; ++j) {
+            state.number_of_threads = threads[j];
+            int64_t *histogram = run_simulation(state);
+            assert(histograms_equal(expected, histogram, 40));
+            free(histogram);
+        }
+        free(expected);
+    }
+}
+
+// Mean and variance of the binomial samples, for both the inversion (small
+// n * p) and the BTPE (large n * p) branch and both halves of p
+void test_binomial_moments() {
+    int64_t n[] = {10, 1000, 1000, 200, 100000, 1000000000};
+    double p[] = {0.3, 0.01, 0.5, 0.9, 0.3, 0.7};
+    const int SAMPLES = 20000;
+    RandomCursor cursor =
+        random_cursor_create(random_stream_create(5, 0, 0), 0);
+
+    for (int i = 0; i < 6; ++i) {
+        double sum = 0;
+        double sum_of_squares = 0;
+        for (int j = 0; j < SAMPLES; ++j) {
+            int64_t x = sample_binomial(&cursor, n[i], p[i]);
+            assert(x >= 0 && x <= n[i]);
+            sum += x;
+            sum_of_squares += (double)x * x;
+        }
+        double mean = sum / SAMPLES;
+        double variance = sum_of_squares / SAMPLES - mean * mean;
+        double expected_mean = n[i] * p[i];
+        double expected_variance = n[i] * p[i] * (1 - p[i]);
+
+        assert(fabs(mean - expected_mean) <
+               6 * sqrt(expected_variance / SAMPLES));
+        assert(fabs(variance / expected_variance - 1) < 0.1);
+    }
+
+    assert(sample_binomial(&cursor, 0, 0.5) == 0);
+    assert(sample_binomial(&cursor, 50, 0) == 0);
+    assert(sample_binomial(&cursor, 50, 1) == 50);
+}
+
+// The directly sampled histogram has to follow the exact distribution just like
+// the simulated one, and both have to be consistent with each other
+void test_multinomial_statistics() {
+    int compartments[] = {2, 11, 40, 200};
+    for (int i = 0; i < 4; ++i) {
+        SimulationState state =
+            create_state(1000000, compartments[i], ENGINE_MULTINOMIAL);
+        int64_t *sampled = run_simulation(state);
+        assert(histogram_sum(sampled, compartments[i]) == 1000000);
+
+        int degrees_of_freedom;
+        double chi_square =
+            chi_square_to_exact(sampled, state, &degrees_of_freedom);
+        assert(chi_square_acceptable(chi_square, degrees_of_freedom));
+
+        state.engine = ENGINE_SIMD;
+        int64_t *simulated = run_simulation(state);
+        chi_square = chi_square_to_exact(simulated, state, &degrees_of_freedom);
+        assert(chi_square_acceptable(chi_square, degrees_of_freedom));
+
+        // Two sample test with equal sample sizes
+        double two_sample = 0;
+        int bins = -1;
+        for (int j = 0; j < compartments[i]; ++j) {
+            double total = sampled[j] + simulated[j];
+            if (total >= 10) {
+                double difference = sampled[j] - simulated[j];
+                two_sample += difference * difference / total;
+                ++bins;
+            }
+        }
+        assert(chi_square_acceptable(two_sample, bins));
+
+        free(sampled);
+        free(simulated);
+    }
+
+    // The cost doesn't depend on the number of balls
+    SimulationState state =
+        create_state(INT64_C(200000000000), 1001, ENGINE_MULTINOMIAL);
+    int64_t *histogram = run_simulation(state);
+    assert(histogram_sum(histogram, 1001) == INT64_C(200000000000));
+    free(histogram);
+}
+
+// Balls past 2^32 still get their own bits, the same in every engine
+void test_large_ball_indices() {
+    SimulationEngine engines[] = {ENGINE_BIT_PARALLEL, ENGINE_SIMD,
+                                  ENGINE_WAVEFRONT};
+    SimulationState state = create_state(2001, 45, ENGINE_BOARD);
+    state.first_ball = (INT64_C(1) << 33) + 12345;
+    int64_t *expected = run_simulation(state);
+    assert(histogram_sum(expected, 45) == 2001);
+
+    for (int i = 0; i < 3; ++i) {
+        state.engine = engines[i];
+        state.number_of_threads = 3;
+        int64_t *histogram = run_simulation(state);
+        assert(histograms_equal(expected, histogram, 45));
+        free(histogram);
+    }
+
+    // Not the histogram of the balls 12345, ... of the same seed
+    SimulationState low = create_state(2001, 45, ENGINE_BOARD);
+    low.first_ball = 12345;
+    int64_t *histogram = run_simulation(low);
+    assert(!histograms_equal(expected, histogram, 45));
+    free(histogram);
+    free(expected);
+}
+
+// --chunk 0 means chunks of INT64_MAX balls, i.e. a single chunk
+void test_number_of_chunks() {
+    assert(number_of_chunks(1000, INT64_MAX) == 1);
+    assert(number_of_chunks(INT64_MAX, INT64_MAX) == 1);
+    assert(number_of_chunks(INT64_MAX - 1, INT64_MAX) == 1);
+    assert(number_of_chunks(0, INT64_MAX) == 0);
+    assert(number_of_chunks(1000, 300) == 4);
+    assert(number_of_chunks(900, 300) == 3);
+    assert(number_of_chunks(INT64_MAX, 2) == INT64_MAX / 2 + 1);
+}
+
+// A board runs number_of_balls + rows time steps, more than INT_MAX for big
+// chunks. Stepping a board across INT_MAX gives the same balls as stepping a
+// new one
+void test_board_past_int_max() {
+    SimulationState state = create_state(100, 3, ENGINE_BOARD);
+    RandomStream stream = ball_stream(state);
+    Board board = create_board(0, state.number_of_rows);
+    Board late = create_board(0, state.number_of_rows);
+    late.time_step = INT32_MAX - 10;
+
+    for (int64_t i = 0; i < state.number_of_balls + state.number_of_rows;
+         ++i) {
+        BoardEntry incoming = {
+            .ball = i < state.number_of_balls ? i : EMPTY, .column = 0};
+        BoardEntry expected = board_step(&board, incoming, stream, state);
+        BoardEntry outgoing = board_step(&late, incoming, stream, state);
+        assert(outgoing.ball == expected.ball);
+        assert(outgoing.column == expected.column);
+    }
+    assert(late.time_step > INT32_MAX);
+
+    destroy_board(&late);
+    destroy_board(&board);
+}
+
+// The bands of the wavefront engine let the balls fall through the same rows
+// with the same bits as the board engine
+void test_wavefront_matches_board() {
+    int compartments[] = {2, 5, 70, 200};
+    for (int i = 0; i < 4; ++i) {
+        SimulationState state =
+            create_state(3001, compartments[i], ENGINE_BOARD);
+        int64_t *expected = run_simulation(state);
+
+        state.engine = ENGINE_WAVEFRONT;
+        int threads[] = {1, 2, 3, 7};
+        for (int j = 0; j < 4; ++j) {
+            state.number_of_threads = threads[j];
+            int64_t *histogram = run_simulation(state);
+            assert(histograms_equal(expected, histogram, compartments[i]));
+            free(histogram);
+        }
+        free(expected);
+    }
+}
+
+// Stops as soon as the histogram is close enough and then has the histogram
+// of the first balls
+void test_early_termination() {
+    SimulationState state = create_state(10000000, 11, ENGINE_BIT_PARALLEL);
+    int64_t *histogram = create_histogram(state);
+    int64_t simulated =
+        simulate_until_converged(state, 1e-4, 10000, histogram);
+    assert(simulated < state.number_of_balls && simulated % 10000 == 0);
+    assert(histogram_sum(histogram, 11) == simulated);
+
+    state.number_of_balls = simulated;
+    assert(kl_divergence_to_exact(histogram, state) <= 1e-4);
+    int64_t *expected = run_simulation(state);
+    assert(histograms_equal(expected, histogram, 11));
+    free(expected);
+
+    // Unreachable tolerance, all balls are simulated
+    memset(histogram, 0, 11 * sizeof(int64_t));
+    assert(simulate_until_converged(state, 0, 7, histogram) == simulated);
+    free(histogram);
+}
+
+// A fair peg map has the binomial distribution, a biased one the distribution
+// computed from its pegs. Both variants give the same histogram for any split
+void test_peg_maps() {
+    SimulationState state = create_state(200000, 30, ENGINE_BOARD);
+    PegMap map = create_peg_map(state.number_of_rows, 0.5);
+    int64_t *histogram = create_histogram(state);
+    simulate_peg_map(state, &map, histogram);
+    int degrees_of_freedom;
+    double chi_square =
+        chi_square_to_exact(histogram, state, &degrees_of_freedom);
+    assert(chi_square_acceptable(chi_square, degrees_of_freedom));
+    free(histogram);
+
+    // Biased to the right, one peg always sends the balls left and one
+    // always right
+    for (int row = 0; row < map.number_of_rows; ++row) {
+        for (int column = 0; column <= row; ++column) {
+            peg_map_set_probability(&map, row, column,
+                                    0.3 + 0.5 * column / (row + 1.0));
+        }
+    }
+    peg_map_set_probability(&map, 10, 3, 0);
+    peg_map_set_probability(&map, 20, 12, 1);
+    assert(peg_map_probability(&map, 10, 3) == 0);
+    assert(peg_map_probability(&map, 20, 12) == 1);
+
+    histogram = create_histogram(state);
+    simulate_peg_map(state, &map, histogram);
+    double *distribution = peg_map_distribution(&map);
+    chi_square = chi_square_to_distribution(histogram, distribution, state,
+                                            &degrees_of_freedom);
+    assert(chi_square_acceptable(chi_square, degrees_of_freedom));
+    free(distribution);
+
+    int64_t *batched = create_histogram(state);
+    SimulationState first = split_balls(state, 0, 2);
+    first.number_of_balls -= 1001;
+    SimulationState second = state;
+    second.first_ball = first.number_of_balls;
+    second.number_of_balls -= first.number_of_balls;
+    simulate_peg_map_batched(first, &map, batched);
+    simulate_peg_map_batched(second, &map, batched);
+    assert(histograms_equal(histogram, batched, 30));
+
+    free(batched);
+    free(histogram);
+    destroy_peg_map(&map);
+}
+
+int main() {
+    test_philox_known_answers();
+    test_random_stream_fill();
+    test_engines_agree();
+    test_split_is_reproducible();
+    test_simd_matches_scalar();
+    test_threads_match_single_thread();
+    test_binomial_moments();
+    test_multinomial_statistics();
+    test_wavefront_matches_board();
+    test_large_ball_indices();
+    test_board_past_int_max();
+    test_number_of_chunks();
+    test_early_termination();
+    test_peg_maps();
+
+    printf("All tests passed!\n");
+
+    return 0;
+}